@@ -0,0 +1,701 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <new>
+
+#include "codec.h"
+
+using namespace std;
+
+// Load generator for server_app. Drives concurrent SMTP and POP3 sessions
+// against a running server and prints one JSON object per phase, so runs
+// from different commits can be compared mechanically:
+//
+//   ./bench_app all --sessions 32 --messages 200 --size 4096 --rcpts 1
+//
+// Mailboxes used are bench<N>@bench.local.
+
+struct BenchConfig {
+    string mode = "all";          // smtp, pop3, all, codec or check
+    string host = "127.0.0.1";
+    int smtp_port = 2525;
+    int pop3_port = 8110;
+    int sessions = 16;            // Concurrent sessions (one thread each)
+    int messages = 100;           // SMTP transactions per session
+    int iterations = 20;          // POP3 logins per session
+    size_t size = 2048;           // Message size in bytes
+    int rcpts = 1;                // Recipients per message
+    int mailboxes = 16;           // Distinct mailboxes to spread load over
+    int populate = 50;            // Messages per mailbox before the POP3 phase
+    int metrics_port = 0;         // Server metrics, read by check for handler allocations
+};
+
+// --- Connection Helpers ---
+
+int connect_to(const string &host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+bool send_all(int sock, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Reads replies through the shared codec. Multi-line bodies are only
+// counted, not kept.
+class ReplyReader {
+public:
+    explicit ReplyReader(int sock) : sock(sock) {}
+
+    bool read(ReplyKind kind, Reply &reply, size_t *body_bytes = nullptr) {
+        decoder.expect(kind, false);
+        while (true) {
+            if (decode_reply(framer, decoder)) {
+                reply = move(decoder.reply);
+                if (body_bytes) *body_bytes = decoder.body_bytes;
+                return true;
+            }
+            char chunk[65536];
+            ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+            if (n <= 0) return false;
+            framer.feed(chunk, n);
+        }
+    }
+
+private:
+    int sock;
+    LineFramer framer;
+    ReplyDecoder decoder;
+};
+
+string mailbox_name(int i) {
+    return "bench" + to_string(i) + "@bench.local";
+}
+
+// A wire-ready message body of roughly 'size' bytes
+string make_body(size_t size, int session, int seq) {
+    string body = "Subject: bench " + to_string(session) + "-" + to_string(seq) + "\r\n"
+                  "From: <load@bench.local>\r\n\r\n";
+    string line(76, 'x');
+    while (body.size() + line.size() + 2 <= size) {
+        body += line + "\r\n";
+    }
+    if (body.size() < size) {
+        body += string(size - body.size() > 2 ? size - body.size() - 2 : 0, 'y') + "\r\n";
+    }
+    return body;
+}
+
+// --- Results ---
+
+struct PhaseResult {
+    string name;
+    vector<uint64_t> latencies_us;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+};
+
+uint64_t percentile(const vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(rank, sorted.size() - 1)];
+}
+
+void print_result(PhaseResult &result, const BenchConfig &config) {
+    sort(result.latencies_us.begin(), result.latencies_us.end());
+    size_t ops = result.latencies_us.size();
+    cout << "{\"phase\":\"" << result.name << "\""
+         << ",\"sessions\":" << config.sessions
+         << ",\"size\":" << config.size
+         << ",\"rcpts\":" << config.rcpts
+         << ",\"ops\":" << ops
+         << ",\"errors\":" << result.errors
+         << ",\"seconds\":" << result.seconds
+         << ",\"ops_per_sec\":" << (result.seconds > 0 ? ops / result.seconds : 0)
+         << ",\"mb_per_sec\":" << (result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0)
+         << ",\"latency_us\":{\"p50\":" << percentile(result.latencies_us, 0.50)
+         << ",\"p99\":" << percentile(result.latencies_us, 0.99)
+         << ",\"p999\":" << percentile(result.latencies_us, 0.999)
+         << ",\"max\":" << (ops ? result.latencies_us.back() : 0) << "}";
+    cout << "}" << endl;
+}
+
+uint64_t elapsed_us(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Run 'sessions' copies of 'body' on their own threads and merge the results
+template <typename SessionFn>
+PhaseResult run_phase(const string &name, int sessions, SessionFn body) {
+    vector<PhaseResult> partial(sessions);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < sessions; ++i) {
+        threads.emplace_back([&partial, &body, i]() { body(i, partial[i]); });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+
+    PhaseResult result;
+    result.name = name;
+    result.seconds = elapsed_us(start) / 1e6;
+    for (PhaseResult &p : partial) {
+        result.latencies_us.insert(result.latencies_us.end(), p.latencies_us.begin(), p.latencies_us.end());
+        result.errors += p.errors;
+        result.bytes += p.bytes;
+    }
+    return result;
+}
+
+// --- SMTP Load ---
+
+// One SMTP session sending 'count' messages; each transaction's envelope is
+// pipelined and its latency runs from MAIL FROM to the final 250. Transaction
+// 'seq' starts its recipients at mailbox first_mailbox + seq * stride.
+void smtp_session(const BenchConfig &config, int session, int count, int first_mailbox, int stride,
+                  PhaseResult &result) {
+    int sock = connect_to(config.host, config.smtp_port);
+    if (sock < 0) {
+        result.errors += count;
+        return;
+    }
+    ReplyReader reader(sock);
+    Reply reply;
+    reader.read(ReplyKind::SMTP, reply);
+    send_all(sock, "EHLO bench\r\n");
+    reader.read(ReplyKind::SMTP, reply);
+
+    for (int seq = 0; seq < count; ++seq) {
+        string envelope = "MAIL FROM:<load@bench.local>\r\n";
+        for (int r = 0; r < config.rcpts; ++r) {
+            int mailbox = (first_mailbox + seq * stride + r) % config.mailboxes;
+            envelope += "RCPT TO:<" + mailbox_name(mailbox) + ">\r\n";
+        }
+        envelope += "DATA\r\n";
+        string body = make_body(config.size, session, seq) + ".\r\n";
+
+        auto start = chrono::steady_clock::now();
+        bool ok = send_all(sock, envelope);
+        for (int i = 0; ok && i < config.rcpts + 2; ++i) {
+            ok = reader.read(ReplyKind::SMTP, reply);
+        }
+        ok = ok && reply.code == 354 && send_all(sock, body) && reader.read(ReplyKind::SMTP, reply) &&
+             reply.code == 250;
+        if (!ok) {
+            ++result.errors;
+            break;
+        }
+        result.latencies_us.push_back(elapsed_us(start));
+        result.bytes += body.size();
+    }
+
+    send_all(sock, "QUIT\r\n");
+    reader.read(ReplyKind::SMTP, reply);
+    close(sock);
+}
+
+// --- POP3 Load ---
+
+// One POP3 session repeatedly logging in and doing STAT, LIST and a RETR;
+// every command's round trip is one latency sample
+void pop3_session(const BenchConfig &config, int session, PhaseResult &result) {
+    mt19937 rng(session);
+    for (int iteration = 0; iteration < config.iterations; ++iteration) {
+        int sock = connect_to(config.host, config.pop3_port);
+        if (sock < 0) {
+            ++result.errors;
+            continue;
+        }
+        ReplyReader reader(sock);
+        Reply reply;
+        size_t bytes = 0;
+        reader.read(ReplyKind::POP3, reply);
+
+        string user = mailbox_name((session + iteration) % config.mailboxes);
+        bool ok = send_all(sock, "USER " + user + "\r\n") && reader.read(ReplyKind::POP3, reply) &&
+                  reply.ok();
+
+        auto start = chrono::steady_clock::now();
+        ok = ok && send_all(sock, "PASS bench\r\n") && reader.read(ReplyKind::POP3, reply) && reply.ok();
+        if (ok) result.latencies_us.push_back(elapsed_us(start));
+
+        start = chrono::steady_clock::now();
+        ok = ok && send_all(sock, "STAT\r\n") && reader.read(ReplyKind::POP3, reply) && reply.ok();
+        int messages = ok ? atoi(reply.text.c_str()) : 0;
+        if (ok) result.latencies_us.push_back(elapsed_us(start));
+
+        start = chrono::steady_clock::now();
+        ok = ok && send_all(sock, "LIST\r\n") && reader.read(ReplyKind::POP3_MULTILINE, reply, &bytes);
+        if (ok) result.latencies_us.push_back(elapsed_us(start));
+
+        if (ok && messages > 0) {
+            int msg = 1 + rng() % messages;
+            start = chrono::steady_clock::now();
+            ok = send_all(sock, "RETR " + to_string(msg) + "\r\n") &&
+                 reader.read(ReplyKind::POP3_MULTILINE, reply, &bytes) && reply.ok();
+            if (ok) {
+                result.latencies_us.push_back(elapsed_us(start));
+                result.bytes += bytes;
+            }
+        }
+
+        if (!ok) ++result.errors;
+        send_all(sock, "QUIT\r\n");
+        reader.read(ReplyKind::POP3, reply);
+        close(sock);
+    }
+}
+
+// --- Codec Micro-Benchmarks ---
+
+// Sizes of the messages the codec phases run on
+const size_t CODEC_SIZES[] = {4096, 1 << 20, 16 << 20};
+
+// Decode a RETR response of 'wire' fed in recv-sized pieces, as the client does
+void codec_decode(const string &wire, size_t piece, PhaseResult &result) {
+    auto start = chrono::steady_clock::now();
+    LineFramer framer;
+    ReplyDecoder decoder;
+    decoder.expect(ReplyKind::POP3_MULTILINE);
+    bool done = false;
+    for (size_t pos = 0; pos < wire.size() && !done; pos += piece) {
+        framer.feed(wire.data() + pos, min(piece, wire.size() - pos));
+        done = decode_reply(framer, decoder);
+    }
+    if (!done) {
+        ++result.errors;
+        return;
+    }
+    result.latencies_us.push_back(elapsed_us(start));
+    result.bytes += wire.size();
+}
+
+const ScanKernel SCAN_KERNELS[] = {ScanKernel::SCALAR, ScanKernel::SSE2, ScanKernel::AVX2};
+const char *SCAN_KERNEL_NAMES[] = {"scalar", "sse2", "avx2"};
+
+// Cases where a vector kernel of the line scanner disagrees with the scalar
+// reference, over random text dense in CR, LF, dots and dashes, starting at
+// every offset so each lane and the scalar tail get their turn
+uint64_t scan_mismatches() {
+    mt19937 rng(25);
+    const char alphabet[] = "\r\n.-x";
+    string text(4096, 'x');
+    for (char &c : text) c = alphabet[rng() % 5];
+    uint64_t mismatches = 0;
+    for (ScanKernel kernel : SCAN_KERNELS) {
+        if (kernel > best_scan_kernel()) continue;
+        for (size_t start = 0; start < 200; ++start) {
+            for (char lead : {'.', '-'}) {
+                const char *data = text.data() + start;
+                size_t len = text.size() - start * 7;
+                size_t pos = 0;
+                // Walk every break, as the callers do
+                while (pos < len) {
+                    size_t want = find_line_break_scalar(data + pos, len - pos, lead);
+                    if (find_line_break(data + pos, len - pos, lead, kernel) != want) ++mismatches;
+                    if (plain_lines(data + pos, len - pos, lead, kernel) !=
+                        plain_lines(data + pos, len - pos, lead, ScanKernel::SCALAR)) {
+                        ++mismatches;
+                    }
+                    pos += want + 1;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+// In-process runs of the shared codec, no server needed: framing and
+// decoding a RETR response, dot-stuffing a body, scanning lines and parsing
+// commands. Throughput should stay flat as the message grows.
+void run_codec(const BenchConfig &config) {
+    for (size_t size : CODEC_SIZES) {
+        BenchConfig shown = config;
+        shown.sessions = 1;
+        shown.size = size;
+        // Every line starts with a dot so stuffing and unstuffing both do work
+        string text;
+        while (text.size() < size) {
+            text += "." + string(76, 'x') + "\n";
+        }
+
+        PhaseResult stuff;
+        stuff.name = "codec_stuff";
+        string wire;
+        auto phase_start = chrono::steady_clock::now();
+        for (int i = 0; i < config.iterations; ++i) {
+            auto start = chrono::steady_clock::now();
+            wire = dot_stuff(text);
+            stuff.latencies_us.push_back(elapsed_us(start));
+            stuff.bytes += text.size();
+        }
+        stuff.seconds = elapsed_us(phase_start) / 1e6;
+        print_result(stuff, shown);
+
+        wire = "+OK " + to_string(wire.size()) + " octets\r\n" + wire + ".\r\n";
+        PhaseResult decode;
+        decode.name = "codec_decode";
+        phase_start = chrono::steady_clock::now();
+        for (int i = 0; i < config.iterations; ++i) {
+            codec_decode(wire, 4096, decode);
+        }
+        decode.seconds = elapsed_us(phase_start) / 1e6;
+        print_result(decode, shown);
+
+        // The line scanner with each kernel over plain CRLF text, which most
+        // DATA and RETR bodies are: it must stop only at the final dot. A
+        // sample scans at least 16 MB so small messages can be timed too.
+        string plain;
+        while (plain.size() + 80 < size) {
+            plain += string(78, 'x') + "\r\n";
+        }
+        plain += ".\r\n";
+        size_t final_dot = plain.size() - 4;  // The LF before it
+        size_t rounds = max<size_t>(1, (16 << 20) / plain.size());
+        uint64_t mismatches = size == CODEC_SIZES[0] ? scan_mismatches() : 0;
+        for (size_t k = 0; k < size_t(sizeof(SCAN_KERNELS) / sizeof(SCAN_KERNELS[0])); ++k) {
+            if (SCAN_KERNELS[k] > best_scan_kernel()) continue;  // Not on this CPU
+            PhaseResult scan;
+            scan.name = string("codec_scan_") + SCAN_KERNEL_NAMES[k];
+            scan.errors = mismatches;
+            phase_start = chrono::steady_clock::now();
+            for (int i = 0; i < config.iterations; ++i) {
+                auto start = chrono::steady_clock::now();
+                for (size_t r = 0; r < rounds; ++r) {
+                    if (find_line_break(plain.data(), plain.size(), '.', SCAN_KERNELS[k]) != final_dot) {
+                        ++scan.errors;
+                    }
+                }
+                scan.latencies_us.push_back(elapsed_us(start));
+                scan.bytes += rounds * plain.size();
+            }
+            scan.seconds = elapsed_us(phase_start) / 1e6;
+            print_result(scan, shown);
+        }
+
+        // Decoding a RETR of that text takes the scanner's block path
+        string plain_wire = "+OK " + to_string(plain.size() - 3) + " octets\r\n" + plain;
+        PhaseResult plain_decode;
+        plain_decode.name = "codec_decode_plain";
+        phase_start = chrono::steady_clock::now();
+        for (int i = 0; i < config.iterations; ++i) {
+            codec_decode(plain_wire, 4096, plain_decode);
+        }
+        plain_decode.seconds = elapsed_us(phase_start) / 1e6;
+        print_result(plain_decode, shown);
+    }
+
+    // One pipelined envelope's worth of commands per sample, framed and
+    // parsed the way the server does it. Whether the server's own handlers
+    // allocate is checked against a running server by ./bench_app check.
+    const string commands = "MAIL FROM:<load@bench.local> SIZE=2048\r\nRCPT TO:<bench1@bench.local>\r\n"
+                            "rcpt to: <bench2@bench.local>\r\nDATA\r\nRETR 17\r\nTOP 3 10\r\nNOOP\r\n";
+    PhaseResult parse;
+    parse.name = "codec_commands";
+    LineFramer framer;
+    Envelope envelope;
+    size_t handled = 0;
+    auto phase_start = chrono::steady_clock::now();
+    for (int i = 0; i <= config.iterations * 1000; ++i) {
+        auto start = chrono::steady_clock::now();
+        framer.feed(commands.data(), commands.size());
+        string_view line;
+        while (framer.next_line(line)) {
+            Command command = parse_command(line);
+            string_view argument = command.argument;
+            long long number = 0;
+            switch (command.verb) {
+            case Verb::MAIL:
+                envelope.set_sender(parse_path(argument, "FROM:"));
+                break;
+            case Verb::RCPT:
+                envelope.add_recipient(parse_path(argument, "TO:"));
+                break;
+            case Verb::RETR:
+            case Verb::TOP:
+                while (take_number(argument, number)) handled += number;
+                break;
+            case Verb::UNKNOWN:
+                ++parse.errors;
+                break;
+            default:
+                ++handled;
+            }
+        }
+        framer.release(1024);
+        // The first round is a warm-up
+        if (i == 0) continue;
+        parse.latencies_us.push_back(elapsed_us(start));
+        parse.bytes += commands.size();
+    }
+    parse.seconds = elapsed_us(phase_start) / 1e6;
+    if (handled == 0 || envelope.recipients() != 2) ++parse.errors;
+    BenchConfig shown = config;
+    shown.sessions = 1;
+    print_result(parse, shown);
+}
+
+// --- Protocol Checks ---
+
+// One scripted SMTP exchange: after the greeting and EHLO, 'commands' go out
+// in a single pipelined write and the reply codes must come back as listed
+struct ProtocolCheck {
+    const char *name;
+    const char *commands;
+    vector<int> expected;
+};
+
+// The server's mail_handler_allocations_total, or -1 when it does not export
+// it (a server_app built without COUNT_ALLOCATIONS)
+int64_t handler_allocations(const BenchConfig &config) {
+    int sock = connect_to(config.host, config.metrics_port);
+    if (sock < 0) return -1;
+    send_all(sock, "GET /metrics HTTP/1.0\r\n\r\n");
+    string text;
+    char buffer[16384];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) text.append(buffer, n);
+    close(sock);
+    const string name = "\nmail_handler_allocations_total ";
+    size_t pos = text.find(name);
+    return pos == string::npos ? -1 : atoll(text.c_str() + pos + name.size());
+}
+
+// Pipelined rounds of the commands that answer from session state, on an
+// SMTP session and on a POP3 session of a small mailbox, run through the
+// server's real handlers. After a warm-up round has sized the sessions'
+// buffers, the rounds must make no heap allocations. Needs --metrics-port
+// and a server built with make server_alloc_app; skipped without the port.
+bool check_allocations(const BenchConfig &config) {
+    if (config.metrics_port == 0) {
+        cout << "{\"check\":\"handler_allocations\",\"skipped\":\"no --metrics-port\"}" << endl;
+        return true;
+    }
+    const int ROUNDS = 100;
+    const int MESSAGES = 3;
+    const string mailbox = "alloc-check@bench.local";
+    const string smtp_round = "EHLO check\r\nMAIL FROM:<check@bench.local> SIZE=2048\r\nRCPT TO:<" + mailbox +
+                              ">\r\nRCPT TO:<check@bench.local>\r\nRSET\r\nNOOP\r\n";
+    const string pop3_round = "STAT\r\nLIST\r\nUIDL\r\nUIDL 1\r\nDELE 1\r\nRSET\r\n";
+    const ReplyKind pop3_replies[] = {ReplyKind::POP3, ReplyKind::POP3_MULTILINE, ReplyKind::POP3_MULTILINE,
+                                      ReplyKind::POP3, ReplyKind::POP3, ReplyKind::POP3};
+
+    int smtp = connect_to(config.host, config.smtp_port);
+    int pop3 = connect_to(config.host, config.pop3_port);
+    ReplyReader smtp_reader(smtp), pop3_reader(pop3);
+    Reply reply;
+    bool ok = smtp >= 0 && pop3 >= 0 && smtp_reader.read(ReplyKind::SMTP, reply) &&
+              pop3_reader.read(ReplyKind::POP3, reply);
+    // Give the mailbox something to list, then log in to it
+    for (int i = 0; ok && i < MESSAGES; ++i) {
+        ok = send_all(smtp, "MAIL FROM:<check@bench.local>\r\nRCPT TO:<" + mailbox + ">\r\nDATA\r\n");
+        for (int j = 0; ok && j < 3; ++j) ok = smtp_reader.read(ReplyKind::SMTP, reply);
+        ok = ok && send_all(smtp, make_body(256, 0, i) + ".\r\n") && smtp_reader.read(ReplyKind::SMTP, reply) &&
+             reply.code == 250;
+    }
+    ok = ok && send_all(pop3, "USER " + mailbox + "\r\nPASS check\r\n") && pop3_reader.read(ReplyKind::POP3, reply) &&
+         pop3_reader.read(ReplyKind::POP3, reply) && reply.ok();
+
+    auto run_rounds = [&](int rounds) {
+        for (int round = 0; ok && round < rounds; ++round) {
+            ok = send_all(smtp, smtp_round);
+            for (int i = 0; ok && i < 6; ++i) ok = smtp_reader.read(ReplyKind::SMTP, reply) && reply.code == 250;
+            ok = ok && send_all(pop3, pop3_round);
+            for (ReplyKind kind : pop3_replies) ok = ok && pop3_reader.read(kind, reply) && reply.ok();
+        }
+    };
+    run_rounds(1);
+    int64_t before = ok ? handler_allocations(config) : -1;
+    run_rounds(ROUNDS);
+    int64_t after = before >= 0 && ok ? handler_allocations(config) : -1;
+
+    // Leave the mailbox empty for the next run
+    int messages = 0;
+    if (ok && send_all(pop3, "STAT\r\n") && pop3_reader.read(ReplyKind::POP3, reply) && reply.ok()) {
+        messages = atoi(reply.text.c_str());
+    }
+    for (int i = 1; i <= messages; ++i) {
+        send_all(pop3, "DELE " + to_string(i) + "\r\n");
+        pop3_reader.read(ReplyKind::POP3, reply);
+    }
+    send_all(pop3, "QUIT\r\n");
+    pop3_reader.read(ReplyKind::POP3, reply);
+    if (smtp >= 0) close(smtp);
+    if (pop3 >= 0) close(pop3);
+
+    bool passed = after >= 0 && after == before;
+    cout << "{\"check\":\"handler_allocations\",\"passed\":" << (passed ? "true" : "false")
+         << ",\"commands\":" << ROUNDS * 12;
+    if (!ok) {
+        cout << ",\"error\":\"session failed\"";
+    } else if (after < 0) {
+        cout << ",\"error\":\"no mail_handler_allocations_total; build with make server_alloc_app\"";
+    } else {
+        cout << ",\"allocations\":" << after - before;
+    }
+    cout << "}" << endl;
+    return passed;
+}
+
+// Run every check against the server, printing one JSON line each; false if
+// any failed
+bool run_checks(const BenchConfig &config) {
+    const ProtocolCheck checks[] = {
+        // A refused MAIL starts no transaction, so the client is not invited
+        // to send the oversize message it just declared
+        {"smtp_size_refused_pipelined",
+         "MAIL FROM:<check@bench.local> SIZE=999999999999\r\nRCPT TO:<check@bench.local>\r\nDATA\r\n",
+         {552, 503, 503}},
+        {"smtp_rcpt_without_mail", "RCPT TO:<check@bench.local>\r\nDATA\r\n", {503, 503}},
+        {"smtp_rset_clears_sender", "MAIL FROM:<check@bench.local>\r\nRSET\r\nRCPT TO:<check@bench.local>\r\n",
+         {250, 250, 503}},
+        {"smtp_null_sender", "MAIL FROM:<>\r\nRCPT TO:<check@bench.local>\r\nRSET\r\n", {250, 250, 250}},
+    };
+    bool all_passed = true;
+    for (const ProtocolCheck &check : checks) {
+        vector<int> codes;
+        int sock = connect_to(config.host, config.smtp_port);
+        if (sock >= 0) {
+            ReplyReader reader(sock);
+            Reply reply;
+            bool ok = reader.read(ReplyKind::SMTP, reply) && send_all(sock, "EHLO check\r\n") &&
+                      reader.read(ReplyKind::SMTP, reply) && send_all(sock, check.commands);
+            for (size_t i = 0; ok && i < check.expected.size(); ++i) {
+                ok = reader.read(ReplyKind::SMTP, reply);
+                if (ok) codes.push_back(reply.code);
+            }
+            close(sock);
+        }
+        bool passed = codes == check.expected;
+        all_passed = all_passed && passed;
+        cout << "{\"check\":\"" << check.name << "\",\"passed\":" << (passed ? "true" : "false") << ",\"replies\":[";
+        for (size_t i = 0; i < codes.size(); ++i) {
+            cout << (i ? "," : "") << codes[i];
+        }
+        cout << "]}" << endl;
+    }
+    return check_allocations(config) && all_passed;
+}
+
+// --- Main Program ---
+
+void print_usage(const char *program) {
+    cerr << "Usage: " << program << " [smtp|pop3|all|codec|check] [options]\n"
+         << "  --host IP           server address (default 127.0.0.1)\n"
+         << "  --smtp-port N       (default 2525)\n"
+         << "  --pop3-port N       (default 8110)\n"
+         << "  --sessions N        concurrent sessions per phase\n"
+         << "  --messages N        SMTP transactions per session\n"
+         << "  --size BYTES        message size\n"
+         << "  --rcpts N           recipients per message\n"
+         << "  --mailboxes N       distinct mailboxes\n"
+         << "  --populate N        messages delivered per mailbox before the POP3 phase\n"
+         << "  --iterations N      POP3 logins per session; codec: runs per phase\n"
+         << "  --metrics-port N    check: server metrics port, to count handler allocations\n";
+}
+
+bool parse_args(int argc, char *argv[], BenchConfig &config) {
+    int i = 1;
+    if (i < argc && argv[i][0] != '-') {
+        config.mode = argv[i++];
+        if (config.mode != "smtp" && config.mode != "pop3" && config.mode != "all" &&
+            config.mode != "codec" && config.mode != "check") {
+            return false;
+        }
+    }
+    for (; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        if (arg == "--host") config.host = value;
+        else if (arg == "--smtp-port") config.smtp_port = stoi(value);
+        else if (arg == "--pop3-port") config.pop3_port = stoi(value);
+        else if (arg == "--sessions") config.sessions = max(1, stoi(value));
+        else if (arg == "--messages") config.messages = max(1, stoi(value));
+        else if (arg == "--size") config.size = max(64, stoi(value));
+        else if (arg == "--rcpts") config.rcpts = max(1, stoi(value));
+        else if (arg == "--mailboxes") config.mailboxes = max(1, stoi(value));
+        else if (arg == "--populate") config.populate = max(0, stoi(value));
+        else if (arg == "--iterations") config.iterations = max(1, stoi(value));
+        else if (arg == "--metrics-port") config.metrics_port = stoi(value);
+        else return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    try {
+        if (!parse_args(argc, argv, config)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    } catch (...) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (config.mode == "codec") {
+        run_codec(config);
+        return 0;
+    }
+    if (config.mode == "check") {
+        return run_checks(config) ? 0 : 1;
+    }
+
+    if (config.mode == "smtp" || config.mode == "all") {
+        PhaseResult result = run_phase("smtp", config.sessions, [&config](int session, PhaseResult &out) {
+            smtp_session(config, session, config.messages, session, 1, out);
+        });
+        print_result(result, config);
+    }
+
+    if (config.mode == "pop3" || config.mode == "all") {
+        if (config.populate > 0) {
+            // One single-recipient session per mailbox so each gets 'populate' messages
+            BenchConfig fill = config;
+            fill.rcpts = 1;
+            fill.sessions = config.mailboxes;
+            PhaseResult result = run_phase("populate", config.mailboxes, [&fill](int mailbox, PhaseResult &out) {
+                smtp_session(fill, mailbox, fill.populate, mailbox, 0, out);
+            });
+            print_result(result, fill);
+        }
+
+        PhaseResult result = run_phase("pop3", config.sessions, [&config](int session, PhaseResult &out) {
+            pop3_session(config, session, out);
+        });
+        print_result(result, config);
+    }
+    return 0;
+}
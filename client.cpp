@@ -7,6 +7,20 @@
 #include <netdb.h>
 #include <vector>
 #include <limits> 
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "codec.h"
 
 using namespace std;
 
@@ -15,6 +29,11 @@ const char* SERVER_IP = "127.0.0.1";
 const int SMTP_PORT = 2525;
 const int POP3_PORT = 8110; 
 
+// Downloaded messages are kept under mail_cache/<user>/<uid>
+const string CACHE_ROOT = "mail_cache";
+// RETRs sent per pipelined batch; bounds what the server has queued for us
+const size_t RETR_BATCH = 32;
+
 // --- Protocol Helper Functions (Shared) ---
 
 // Send a command to the server (adds \r\n)
@@ -24,33 +43,71 @@ void send_command(int sock, const string& command) {
     // cout << "Client Sent: " << command << endl; // Commented out for cleaner UI
 }
 
-// Function to receive and print server response for general commands (SMTP/POP3)
-string receive_response(int sock, bool check_dot = false) {
-    char buffer[4096] = {0};
-    string response = "";
-    
-    // Read data until disconnection or termination sequence is found
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+// Reads replies off a socket through the shared codec. Bytes are framed as
+// they arrive and each is scanned once, so a multi-megabyte RETR costs
+// linear time; replies to pipelined commands are read back one at a time.
+class ResponseReader {
+public:
+    explicit ResponseReader(int sock) : sock(sock) {}
 
-        if (bytes_received <= 0) break;
-        
-        string received_chunk(buffer, bytes_received);
-        response += received_chunk;
-
-        if (check_dot) {
-            // POP3 message termination: look for "\r\n.\r\n" OR just ".\r\n" at the end
-            if (response.find("\r\n.\r\n") != string::npos || 
-                (response.length() >= 3 && response.substr(response.length() - 3) == ".\r\n")) {
-                break;
+    // Read one complete reply of the given kind
+    bool read_reply(ReplyKind kind, Reply& reply) {
+        decoder.expect(kind);
+        while (true) {
+            if (decode_reply(framer, decoder)) {
+                reply = move(decoder.reply);
+                return true;
             }
-        } else {
-            // For standard single-line responses, break after finding a newline
-            if (response.find("\r\n") != string::npos) break;
+            char chunk[65536];
+            int bytes_received = recv(sock, chunk, sizeof(chunk), 0);
+            if (bytes_received <= 0) return false;
+            framer.feed(chunk, bytes_received);
+        }
+    }
+
+private:
+    int sock;
+    LineFramer framer;
+    ReplyDecoder decoder;
+};
+
+// --- Local Message Cache ---
+
+string cache_dir(const string& user_email) {
+    return CACHE_ROOT + "/" + user_email;
+}
+
+bool load_cached(const string& dir, const string& uid, string& content) {
+    ifstream infile(dir + "/" + uid, ios::binary);
+    if (!infile.is_open()) return false;
+    stringstream buffer;
+    buffer << infile.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// Write via a temporary name so an interrupted client never leaves half a message
+void store_cached(const string& dir, const string& uid, const string& content) {
+    string tmp = dir + "/." + uid;
+    ofstream outfile(tmp, ios::binary | ios::trunc);
+    outfile << content;
+    outfile.close();
+    if (outfile) rename(tmp.c_str(), (dir + "/" + uid).c_str());
+}
+
+// Forget messages the server no longer has
+void prune_cache(const string& dir, const unordered_set<string>& keep) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent* entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name[0] == '.' && name != "." && name != "..") {
+            unlink((dir + "/" + name).c_str());  // Leftover temporary file
+        } else if (name[0] != '.' && !keep.count(name)) {
+            unlink((dir + "/" + name).c_str());
         }
     }
-    return response;
+    closedir(d);
 }
 
 // --- SMTP Sending Logic ---
@@ -71,7 +128,9 @@ void send_mail(const string& sender_email) {
         return;
     }
 
-    receive_response(client_socket); // 220 Greeting
+    ResponseReader reader(client_socket);
+    Reply reply;
+    reader.read_reply(ReplyKind::SMTP, reply); // 220 Greeting
 
     // 2. Get Input
     string recipient, subject, line;
@@ -95,10 +154,10 @@ void send_mail(const string& sender_email) {
     }
 
     // 3. SMTP Conversation
-    send_command(client_socket, "HELO localhost"); receive_response(client_socket);
-    send_command(client_socket, "MAIL FROM: <" + sender_email + ">"); receive_response(client_socket);
-    send_command(client_socket, "RCPT TO: <" + recipient + ">"); receive_response(client_socket);
-    send_command(client_socket, "DATA"); receive_response(client_socket);
+    send_command(client_socket, "HELO localhost"); reader.read_reply(ReplyKind::SMTP, reply);
+    send_command(client_socket, "MAIL FROM:<" + sender_email + ">"); reader.read_reply(ReplyKind::SMTP, reply);
+    send_command(client_socket, "RCPT TO:<" + recipient + ">"); reader.read_reply(ReplyKind::SMTP, reply);
+    send_command(client_socket, "DATA"); reader.read_reply(ReplyKind::SMTP, reply);
     
     // Construct and send message block
     string full_email_message;
@@ -106,7 +165,7 @@ void send_mail(const string& sender_email) {
     full_email_message += "From: <" + sender_email + ">\r\n";
     full_email_message += "To: <" + recipient + ">\r\n";
     full_email_message += "\r\n"; 
-    full_email_message += body_content; 
+    full_email_message += dot_stuff(body_content);
     
     
     // 4. Send Message Block
@@ -116,17 +175,17 @@ void send_mail(const string& sender_email) {
     send_command(client_socket, ".");
     
     // 6. Wait for Final Server Response
-    string final_response = receive_response(client_socket); 
+    bool accepted = reader.read_reply(ReplyKind::SMTP, reply) && reply.code == 250;
 
     
     // Final check and cleanup
-    if (final_response.find("250") != string::npos) {
+    if (accepted) {
         cout << "\n[SUCCESS] Message accepted for delivery to " << recipient << ".\n";
     } else {
-        cout << "\n[ERROR] Message sending failed: " << final_response << endl;
+        cout << "\n[ERROR] Message sending failed: " << reply.code << " " << reply.text << endl;
     }
 
-    send_command(client_socket, "QUIT"); receive_response(client_socket);
+    send_command(client_socket, "QUIT"); reader.read_reply(ReplyKind::SMTP, reply);
     close(client_socket);
 }
 
@@ -147,60 +206,73 @@ void display_mailbox(const string& user_email) {
         close(client_socket);
         return;
     }
-    receive_response(client_socket); // +OK Greeting
+    ResponseReader reader(client_socket);
+    Reply reply;
+    reader.read_reply(ReplyKind::POP3, reply); // +OK Greeting
 
     // 2. POP3 Authentication (USER/PASS)
     send_command(client_socket, "USER " + user_email); 
-    receive_response(client_socket);
+    reader.read_reply(ReplyKind::POP3, reply);
     send_command(client_socket, "PASS");
-    receive_response(client_socket); // Just consume the PASS response
-    
-    // 3. Send STAT command to get message count
-    send_command(client_socket, "STAT");
-    string stat_response = receive_response(client_socket);
-
-    // 4. Parse STAT response for message count
-    size_t start = stat_response.find(' ') + 1;
-    size_t end = stat_response.find(' ', start);
-    int num_messages = 0;
-    if (start != string::npos && end != string::npos && stat_response.find("+OK") != string::npos) {
-        try { num_messages = stoi(stat_response.substr(start, end - start)); } catch(...) { /* Error parsing */ }
+    reader.read_reply(ReplyKind::POP3, reply); // Just consume the PASS response
+
+    // 3. UIDL: which messages the server has, by stable unique id
+    vector<pair<int, string>> messages;
+    send_command(client_socket, "UIDL");
+    bool ok = reader.read_reply(ReplyKind::POP3_MULTILINE, reply) && reply.ok();
+    istringstream listing(reply.body);
+    string line;
+    while (ok && getline(listing, line)) {
+        size_t space = line.find(' ');
+        if (space != string::npos) {
+            messages.push_back({atoi(line.c_str()), line.substr(space + 1)});
+        }
     }
-    
+
+    // 4. Fetch only what the local cache does not have yet, pipelining the
+    //    RETRs in batches instead of waiting a round trip per message
+    string dir = cache_dir(user_email);
+    mkdir(CACHE_ROOT.c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+    vector<size_t> missing;
+    unordered_set<string> on_server;
+    struct stat st;
+    for (size_t i = 0; i < messages.size(); i++) {
+        on_server.insert(messages[i].second);
+        if (stat((dir + "/" + messages[i].second).c_str(), &st) != 0) missing.push_back(i);
+    }
+    for (size_t first = 0; ok && first < missing.size(); first += RETR_BATCH) {
+        size_t last = min(missing.size(), first + RETR_BATCH);
+        string batch;
+        for (size_t m = first; m < last; m++) {
+            batch += "RETR " + to_string(messages[missing[m]].first) + "\r\n";
+        }
+        send(client_socket, batch.c_str(), batch.length(), 0);
+        for (size_t m = first; ok && m < last; m++) {
+            ok = reader.read_reply(ReplyKind::POP3_MULTILINE, reply);
+            if (ok && reply.ok()) store_cached(dir, messages[missing[m]].second, reply.body);
+        }
+    }
+    if (ok) prune_cache(dir, on_server);
+
+    int num_messages = messages.size();
     cout << "\n========================================\n";
     cout << "         YOUR MAILBOX (" << user_email << ")\n";
     cout << "========================================\n";
 
-    if (num_messages > 0) {
-        cout << "[STATUS] You have " << num_messages << " new message(s).\n\n";
+    if (!ok) {
+        cout << "[ERROR] Could not synchronize with the server.\n";
+    } else if (num_messages > 0) {
+        cout << "[STATUS] You have " << num_messages << " message(s), " << missing.size() << " new.\n\n";
 
-        // 5. Retrieve and display all messages
+        // 5. Display all messages from the local cache
         for (int i = 1; i <= num_messages; i++) {
             cout << "--- Message " << i << " of " << num_messages << " ---\n";
-            send_command(client_socket, "RETR " + to_string(i));
-            string email_content = receive_response(client_socket, true);
-            
-            // Display the cleaned content - skip the +OK line and the terminating dot
-            size_t content_start = email_content.find("\r\n");
-            if (content_start != string::npos) {
-                content_start += 2; // Skip the \r\n
-                
-                // Find the terminating sequence
-                size_t content_end = email_content.rfind("\r\n.\r\n");
-                if (content_end == string::npos) {
-                    content_end = email_content.rfind(".\r\n");
-                    if (content_end != string::npos && content_end > content_start) {
-                        //content_end -= 2; //
-                    }
-                }
-                
-                if (content_end != string::npos && content_end > content_start) {
-                    string clean_content = email_content.substr(content_start, content_end - content_start);
-                    cout << clean_content << endl;
-                } else {
-                    // Fallback: just print everything after the first line
-                    cout << email_content.substr(content_start) << endl;
-                }
+            string email_content;
+            if (load_cached(dir, messages[i - 1].second, email_content)) {
+                cout << email_content << endl;
+            } else {
+                cout << "[ERROR] Message could not be retrieved." << endl;
             }
             cout << "----------------------------------------\n";
             if (i < num_messages) cout << endl; // Add spacing between messages
@@ -211,13 +283,429 @@ void display_mailbox(const string& user_email) {
         cout << "----------------------------------------\n";
     }
 
-    send_command(client_socket, "QUIT"); receive_response(client_socket);
+    send_command(client_socket, "QUIT"); reader.read_reply(ReplyKind::POP3, reply);
     close(client_socket);
 }
 
+// --- Batch Sending ---
+//
+// "client_app --batch FILE" sends every message of an mbox file (or of stdin
+// for "-") without prompting. Several workers each keep one SMTP session open
+// for the whole run: every transaction starts with RSET and its envelope goes
+// out in one write, so a message costs two round trips instead of a
+// connection, a greeting and a reply per command.
+
+struct BatchConfig {
+    string input;                // mbox file, or "-" for stdin
+    int workers = 4;             // Parallel SMTP sessions
+    string sender;               // Replaces every message's envelope sender
+    vector<string> recipients;   // Replace the recipients taken from To:/Cc:
+};
+
+struct OutgoingMessage {
+    size_t number = 0;           // Position in the input, from 1
+    string sender;
+    vector<string> recipients;
+    string data;                 // Dot-stuffed CRLF lines, without the final dot
+};
+
+// Addresses in a To:, Cc: or From: value, either "Name <a@b>" or a bare
+// a@b; commas inside a quoted display name do not split it
+void parse_addresses(const string& value, vector<string>& addresses) {
+    string part;
+    bool quoted = false;
+    for (size_t i = 0; i <= value.size(); ++i) {
+        char c = i < value.size() ? value[i] : ',';
+        if (c == '"') quoted = !quoted;
+        if (c != ',' || quoted) {
+            part += c;
+            continue;
+        }
+        string address;
+        size_t open = part.rfind('<');
+        if (open != string::npos) {
+            address = part.substr(open + 1, part.find('>', open) - open - 1);
+        } else {
+            istringstream words(part);
+            string word;
+            while (words >> word && address.empty()) {
+                if (word.find('@') != string::npos) address = word;
+            }
+        }
+        if (address.find('@') != string::npos) addresses.push_back(address);
+        part.clear();
+    }
+}
+
+// Splits an mbox stream into messages. Each starts at a "From sender date"
+// line, which gives its envelope sender, and ">From " quoting in the text is
+// undone (mboxrd). Input that does not start with "From " is one message.
+// Recipients come from the To: and Cc: headers; a message without an
+// envelope sender falls back to its From: header.
+class MboxReader {
+public:
+    explicit MboxReader(istream& in) : in(in) {}
+
+    bool next(OutgoingMessage& message) {
+        message = OutgoingMessage();
+        bool started = false;
+        if (!separator.empty()) {
+            message.sender = separator_sender(separator);
+            separator.clear();
+            started = true;
+        }
+        bool in_headers = true;
+        string header, from_header, line;
+        size_t blank_lines = 0;  // Held back: the one before a separator is not text
+        while (getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.compare(0, 5, "From ") == 0) {
+                if (started || !message.data.empty() || blank_lines > 0) {
+                    separator = line;
+                    break;
+                }
+                message.sender = separator_sender(line);
+                started = true;
+                continue;
+            }
+            if (in_headers) {
+                if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) {
+                    header += line;
+                } else {
+                    take_header(header, message.recipients, from_header);
+                    header = line;
+                    in_headers = !line.empty();
+                }
+            }
+            if (line.empty()) {
+                ++blank_lines;
+                continue;
+            }
+            for (; blank_lines > 0; --blank_lines) message.data += "\r\n";
+            // mboxrd: ">From ", ">>From " and so on lose one '>'
+            size_t quotes = line.find_first_not_of('>');
+            if (quotes > 0 && quotes != string::npos && line.compare(quotes, 5, "From ") == 0) {
+                line.erase(0, 1);
+            }
+            append_stuffed_line(message.data, line);
+        }
+        if (in_headers) take_header(header, message.recipients, from_header);
+        if (!started && message.data.empty()) return false;
+        for (; blank_lines > 1; --blank_lines) message.data += "\r\n";
+        if (message.sender.empty() && !from_header.empty()) {
+            vector<string> senders;
+            parse_addresses(from_header, senders);
+            if (!senders.empty()) message.sender = senders[0];
+        }
+        message.number = ++count;
+        return true;
+    }
+
+private:
+    // "From a@b Thu Jan  1 00:00:00 2026"; MAILER-DAEMON stands for no sender
+    static string separator_sender(const string& line) {
+        size_t end = line.find(' ', 5);
+        string sender = line.substr(5, end == string::npos ? string::npos : end - 5);
+        return sender == "MAILER-DAEMON" || sender == "-" ? "" : sender;
+    }
+
+    // Use an unfolded header line if it names recipients or the author
+    static void take_header(const string& header, vector<string>& recipients, string& from_header) {
+        size_t colon = header.find(':');
+        if (colon == string::npos) return;
+        string name = header.substr(0, colon);
+        if (strcasecmp(name.c_str(), "To") == 0 || strcasecmp(name.c_str(), "Cc") == 0) {
+            parse_addresses(header.substr(colon + 1), recipients);
+        } else if (strcasecmp(name.c_str(), "From") == 0) {
+            from_header = header.substr(colon + 1);
+        }
+    }
+
+    istream& in;
+    string separator;  // The "From " line that ended the previous message
+    size_t count = 0;
+};
+
+// Carries messages from the reader to the workers. It is bounded, so a large
+// input is streamed through rather than loaded whole.
+class MessageQueue {
+public:
+    explicit MessageQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(OutgoingMessage&& message) {
+        unique_lock<mutex> lock(mtx);
+        not_full.wait(lock, [&] { return queue.size() < capacity; });
+        queue.push_back(move(message));
+        not_empty.notify_one();
+    }
+
+    // No more messages are coming; pop() drains the rest, then fails
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    bool pop(OutgoingMessage& message) {
+        unique_lock<mutex> lock(mtx);
+        not_empty.wait(lock, [&] { return !queue.empty() || closed; });
+        if (queue.empty()) return false;
+        message = move(queue.front());
+        queue.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+private:
+    mutex mtx;
+    condition_variable not_empty, not_full;
+    deque<OutgoingMessage> queue;
+    size_t capacity;
+    bool closed = false;
+};
+
+// One worker's SMTP session. It is opened on first use and kept for every
+// message after that.
+class SmtpSession {
+public:
+    ~SmtpSession() {
+        if (sock < 0) return;
+        Reply reply;
+        send_command(sock, "QUIT");
+        reader.read_reply(ReplyKind::SMTP, reply);
+        close(sock);
+    }
+
+    // Send one message. On failure 'note' says why; on success it may list
+    // recipients the server refused. A session the server dropped before the
+    // message went out is reopened once, so an idle timeout costs a
+    // reconnect rather than the message.
+    bool deliver(const OutgoingMessage& message, string& note) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (sock < 0 && !open_session(note)) return false;
+            bool retry = false;
+            if (transact(message, note, retry)) return true;
+            if (!retry) return false;
+            drop_session();
+        }
+        return false;
+    }
+
+    int sessions = 0;  // Connections opened
+
+private:
+    bool open_session(string& note) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in server_addr = {};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(SMTP_PORT);
+        inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            note = "could not connect to SMTP server on port " + to_string(SMTP_PORT);
+            if (sock >= 0) close(sock);
+            sock = -1;
+            return false;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        reader = ResponseReader(sock);
+        Reply reply;
+        bool ok = reader.read_reply(ReplyKind::SMTP, reply) && reply.code == 220 &&
+                  send_all("EHLO localhost\r\n") && reader.read_reply(ReplyKind::SMTP, reply) &&
+                  reply.code == 250;
+        if (!ok) {
+            note = "session refused: " + to_string(reply.code) + " " + reply.text;
+            close(sock);
+            sock = -1;
+            return false;
+        }
+        ++sessions;
+        return true;
+    }
+
+    // RSET, MAIL, RCPT and DATA in one write, then the text. 'retry' is set
+    // when the connection failed before any of the text was sent.
+    bool transact(const OutgoingMessage& message, string& note, bool& retry) {
+        string envelope = "RSET\r\nMAIL FROM:<" + message.sender + "> SIZE=" +
+                          to_string(message.data.size()) + "\r\n";
+        for (const string& recipient : message.recipients) {
+            envelope += "RCPT TO:<" + recipient + ">\r\n";
+        }
+        envelope += "DATA\r\n";
+
+        Reply reset, mail, reply;
+        retry = true;
+        note = "connection lost";
+        if (!send_all(envelope) || !reader.read_reply(ReplyKind::SMTP, reset) ||
+            !reader.read_reply(ReplyKind::SMTP, mail)) {
+            return false;
+        }
+        string refused;
+        size_t accepted = 0;
+        for (const string& recipient : message.recipients) {
+            if (!reader.read_reply(ReplyKind::SMTP, reply)) return false;
+            if (reply.code == 250 || reply.code == 251) {
+                ++accepted;
+            } else {
+                refused += (refused.empty() ? "" : ", ") + recipient + " (" + to_string(reply.code) + ")";
+            }
+        }
+        if (!reader.read_reply(ReplyKind::SMTP, reply)) return false;
+        retry = false;
+        string failure;
+        if (mail.code != 250) {
+            failure = "MAIL FROM refused: " + to_string(mail.code) + " " + mail.text;
+        } else if (accepted == 0) {
+            failure = "all recipients refused: " + refused;
+        } else if (reply.code != 354) {
+            failure = "DATA refused: " + to_string(reply.code) + " " + reply.text;
+            if (!refused.empty()) failure += "; refused recipients " + refused;
+        }
+        if (!failure.empty()) {
+            // Giving up on the transaction. A server that still answered DATA
+            // with 354 now takes whatever comes next as message text, so the
+            // session is dropped: the next envelope would only be swallowed,
+            // and ending the text with a dot could deliver an empty message.
+            note = failure;
+            if (reply.code == 354) drop_session();
+            return false;
+        }
+        if (!send_all(message.data + ".\r\n") || !reader.read_reply(ReplyKind::SMTP, reply)) {
+            note = "connection lost after the message text; it may or may not have been accepted";
+            drop_session();
+            return false;
+        }
+        if (reply.code != 250) {
+            note = "message refused: " + to_string(reply.code) + " " + reply.text;
+            return false;
+        }
+        note = refused.empty() ? "" : "refused recipients " + refused;
+        return true;
+    }
+
+    // Close the connection; the next message opens a new one
+    void drop_session() {
+        close(sock);
+        sock = -1;
+    }
+
+    bool send_all(const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    int sock = -1;
+    ResponseReader reader{-1};
+};
+
+int run_batch(const BatchConfig& config) {
+    ifstream file;
+    istream* in = &cin;
+    if (config.input != "-") {
+        file.open(config.input, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Cannot open " << config.input << endl;
+            return 1;
+        }
+        in = &file;
+    }
+
+    MessageQueue queue(config.workers * 64);
+    atomic<size_t> sent{0}, failed{0};
+    atomic<int> sessions{0};
+    mutex report_mtx;
+    auto report = [&](const char* level, size_t number, const string& note) {
+        lock_guard<mutex> lock(report_mtx);
+        cerr << "[" << level << "] Message " << number << ": " << note << "\n";
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int w = 0; w < config.workers; ++w) {
+        workers.emplace_back([&] {
+            SmtpSession session;
+            OutgoingMessage message;
+            string note;
+            while (queue.pop(message)) {
+                if (session.deliver(message, note)) {
+                    ++sent;
+                    if (!note.empty()) report("WARNING", message.number, note);
+                } else {
+                    ++failed;
+                    report("ERROR", message.number, note);
+                }
+            }
+            sessions += session.sessions;
+        });
+    }
+
+    MboxReader reader(*in);
+    OutgoingMessage message;
+    while (reader.next(message)) {
+        if (!config.sender.empty()) message.sender = config.sender;
+        if (!config.recipients.empty()) message.recipients = config.recipients;
+        if (message.recipients.empty()) {
+            ++failed;
+            report("ERROR", message.number, "no recipients");
+            continue;
+        }
+        queue.push(move(message));
+    }
+    queue.close();
+    for (thread& worker : workers) worker.join();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t total = sent + failed;
+    cout << "[STATUS] Sent " << sent << " of " << total << " message(s), " << failed << " failed, in "
+         << seconds << " s (" << (size_t)(seconds > 0 ? sent * 60 / seconds : 0) << " per minute, "
+         << sessions << " SMTP session(s))" << endl;
+    return failed == 0 ? 0 : 1;
+}
+
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << "                  interactive client\n"
+         << "       " << program << " --batch FILE|- [options]\n"
+         << "  --workers N         parallel SMTP sessions (default 4)\n"
+         << "  --from ADDR         envelope sender for every message\n"
+         << "  --rcpt ADDR         recipient for every message; may be repeated\n";
+}
+
+bool parse_args(int argc, char* argv[], BatchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        if (arg == "--batch") config.input = value;
+        else if (arg == "--workers") config.workers = max(1, stoi(value));
+        else if (arg == "--from") config.sender = value;
+        else if (arg == "--rcpt") config.recipients.push_back(value);
+        else return false;
+    }
+    return !config.input.empty();
+}
+
 // --- Main Program ---
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        BatchConfig config;
+        bool valid = false;
+        try {
+            valid = parse_args(argc, argv, config);
+        } catch (...) {
+        }
+        if (!valid) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_batch(config);
+    }
+
     string user_email;
     int choice = 0;
     
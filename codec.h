@@ -0,0 +1,503 @@
+#ifndef MAIL_CODEC_H
+#define MAIL_CODEC_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <charconv>
+#include <cstring>
+#include <strings.h>
+#include <cstdlib>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Incremental SMTP/POP3 codec shared by server_app, client_app and
+// bench_app. It only works on bytes: callers feed it whatever recv()
+// returned and take complete lines, commands or replies out of it. Every
+// byte is scanned once, however the stream is split into reads, so a
+// multi-megabyte RETR decodes in linear time.
+
+// --- Line Scanning ---
+//
+// Message text is mostly lines that need nothing done to them. The only ones
+// that do are a line starting with a given lead byte ('.' for the end of DATA
+// and dot-stuffing, '-' for a mailbox delimiter) and a line ending in a bare
+// LF, which is stored or sent as CRLF. The scanner finds the next such line
+// end 16 or 32 bytes at a time, so runs of ordinary lines are handled as one
+// block instead of line by line.
+
+enum class ScanKernel { SCALAR, SSE2, AVX2 };
+
+// Whether the LF at data[i] ends an ordinary line: it follows a CR and the
+// next line does not start with 'lead'. An LF at offset 0 counts as bare; one
+// in the last byte is judged on the CR alone, as the next byte is not known.
+inline bool ordinary_line_end(const char *data, size_t len, size_t i, char lead) {
+    return i > 0 && data[i - 1] == '\r' && (i + 1 == len || data[i + 1] != lead);
+}
+
+// The byte-at-a-time reference that the vector kernels must agree with
+inline size_t find_line_break_scalar(const char *data, size_t len, char lead, size_t from = 0) {
+    for (size_t i = from; i < len; ++i) {
+        if (data[i] == '\n' && !ordinary_line_end(data, len, i, lead)) return i;
+    }
+    return len;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so this kernel needs no check. Each block compares
+// the bytes at i, i - 1 and i + 1 with LF, CR and 'lead' in three loads; the
+// first and last bytes, whose neighbours may be missing, go to the scalar loop.
+inline size_t find_line_break_sse2(const char *data, size_t len, char lead) {
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), first = _mm_set1_epi8(lead);
+    if (len > 0 && data[0] == '\n') return 0;
+    size_t i = 1;
+    for (; i + 17 <= len; i += 16) {
+        __m128i here = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i before = _mm_loadu_si128((const __m128i *)(data + i - 1));
+        __m128i after = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        __m128i odd = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(before, cr), _mm_set1_epi8(-1)),
+                                   _mm_cmpeq_epi8(after, first));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(here, lf), odd));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_line_break_scalar(data, len, lead, i);
+}
+
+__attribute__((target("avx2")))
+inline size_t find_line_break_avx2(const char *data, size_t len, char lead) {
+    const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r'), first = _mm256_set1_epi8(lead);
+    if (len > 0 && data[0] == '\n') return 0;
+    size_t i = 1;
+    for (; i + 33 <= len; i += 32) {
+        __m256i here = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i before = _mm256_loadu_si256((const __m256i *)(data + i - 1));
+        __m256i after = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+        __m256i odd = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(before, cr), _mm256_set1_epi8(-1)),
+                                      _mm256_cmpeq_epi8(after, first));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(here, lf), odd));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_line_break_scalar(data, len, lead, i);
+}
+#endif
+
+// The fastest kernel this CPU runs, decided once
+inline ScanKernel best_scan_kernel() {
+#if defined(__x86_64__)
+    static const ScanKernel kernel = __builtin_cpu_supports("avx2") ? ScanKernel::AVX2 : ScanKernel::SSE2;
+    return kernel;
+#else
+    return ScanKernel::SCALAR;
+#endif
+}
+
+// Offset of the first LF in data[0, len) that does not end an ordinary
+// line (see ordinary_line_end()), or 'len' if there is none
+inline size_t find_line_break(const char *data, size_t len, char lead, ScanKernel kernel = best_scan_kernel()) {
+#if defined(__x86_64__)
+    if (kernel == ScanKernel::AVX2) return find_line_break_avx2(data, len, lead);
+    if (kernel == ScanKernel::SSE2) return find_line_break_sse2(data, len, lead);
+#endif
+    return find_line_break_scalar(data, len, lead);
+}
+
+// Length of the run of complete lines at the start of data[0, len) that can
+// be taken as they are: each ends in CRLF and none starts with 'lead'. Zero
+// when the first line is not one of them or has not fully arrived.
+inline size_t plain_lines(const char *data, size_t len, char lead, ScanKernel kernel = best_scan_kernel()) {
+    if (len == 0 || data[0] == lead) return 0;
+    size_t stop = find_line_break(data, len, lead, kernel);
+    if (stop < len && stop > 0 && data[stop - 1] == '\r') {
+        return stop + 1;  // A CRLF followed by a line starting with 'lead'
+    }
+    // Up to the last line end before the bare LF, or before the unfinished line
+    const void *last = memrchr(data, '\n', stop);
+    return last ? (const char *)last - data + 1 : 0;
+}
+
+// --- Line Framing ---
+
+// Splits a byte stream into lines ending in CRLF (a bare LF is accepted).
+// Partial lines stay buffered until the rest arrives; consumed bytes are
+// dropped once they make up half the buffer, so compaction is amortized too.
+class LineFramer {
+public:
+    // A line longer than 'max_line' without its terminator is an overflow;
+    // zero means no limit
+    explicit LineFramer(size_t max_line = 0) : max_line(max_line) {}
+
+    void feed(const char *data, size_t len) {
+        if (pos > 0 && pos >= buffer.size() / 2) {
+            buffer.erase(0, pos);
+            scanned -= pos;
+            pos = 0;
+        }
+        buffer.append(data, len);
+    }
+
+    // Take the next complete line, without its line end. The view points
+    // into the buffer and stays valid until the next feed() or release().
+    bool next_line(std::string_view &line) {
+        const char *start = buffer.data() + scanned;
+        const char *eol = (const char *)memchr(start, '\n', buffer.size() - scanned);
+        if (!eol) {
+            scanned = buffer.size();
+            return false;
+        }
+        size_t end = eol - buffer.data();
+        size_t len = end - pos;
+        if (len > 0 && buffer[end - 1] == '\r') --len;
+        line = std::string_view(buffer.data() + pos, len);
+        pos = end + 1;
+        scanned = pos;
+        return true;
+    }
+
+    // Take the complete lines that plain_lines() accepts as one block, line
+    // ends included. False when the next line has to be taken on its own:
+    // it starts with 'lead', ends in a bare LF or has not fully arrived.
+    bool next_lines(std::string_view &block, char lead) {
+        if (!memchr(buffer.data() + scanned, '\n', buffer.size() - scanned)) {
+            scanned = buffer.size();
+            return false;
+        }
+        size_t len = plain_lines(buffer.data() + pos, buffer.size() - pos, lead);
+        if (len == 0) return false;
+        block = std::string_view(buffer.data() + pos, len);
+        pos += len;
+        if (scanned < pos) scanned = pos;
+        return true;
+    }
+
+    // The same, copied out
+    bool next_line(std::string &line) {
+        std::string_view view;
+        if (!next_line(view)) return false;
+        line.assign(view.data(), view.size());
+        return true;
+    }
+
+    // Bytes not yet taken, complete lines included
+    size_t pending() const { return buffer.size() - pos; }
+
+    // Bytes after the last line end: the one line still being received
+    size_t tail() const {
+        const char *eol = (const char *)memrchr(buffer.data() + pos, '\n', pending());
+        return eol ? buffer.data() + buffer.size() - eol - 1 : pending();
+    }
+
+    bool overflow() const { return max_line > 0 && tail() > max_line; }
+
+    // Empty the buffer once everything has been consumed. Memory beyond
+    // 'keep' bytes is given back, so an idle session costs little here while
+    // one trading short commands does not reallocate on every read.
+    void release(size_t keep = 0) {
+        if (pending() > 0) return;
+        if (buffer.capacity() > keep) {
+            std::string().swap(buffer);
+        } else {
+            buffer.clear();
+        }
+        pos = scanned = 0;
+    }
+
+private:
+    std::string buffer;
+    size_t pos = 0;      // Start of the first unconsumed line
+    size_t scanned = 0;  // Bytes from 'pos' up to here hold no line end
+    size_t max_line;
+};
+
+// --- Dot-Stuffing ---
+
+// A line of message text as it goes on the wire: a leading dot is doubled
+// so it cannot be mistaken for the terminator (RFC 5321 4.5.2, RFC 1939 3)
+inline void append_stuffed_line(std::string &out, const std::string &line) {
+    if (!line.empty() && line[0] == '.') out += '.';
+    out += line;
+    out += "\r\n";
+}
+
+// Text with any line ends, as wire-ready CRLF lines ending in CRLF
+inline std::string dot_stuff(const std::string &text) {
+    std::string out;
+    out.reserve(text.size() + text.size() / 32 + 2);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        size_t end = eol == std::string::npos ? text.size() : eol;
+        size_t len = end - pos;
+        if (len > 0 && text[end - 1] == '\r') --len;
+        append_stuffed_line(out, text.substr(pos, len));
+        pos = end + 1;
+    }
+    return out;
+}
+
+// A received line of a multi-line body, with its dot-stuffing undone
+inline void append_unstuffed_line(std::string &out, const std::string &line) {
+    out.append(line, (!line.empty() && line[0] == '.') ? 1 : 0, std::string::npos);
+}
+
+// --- Commands ---
+//
+// Commands are parsed in place: the verb is looked up without copying it and
+// the argument is a view into the line, so handling a command allocates
+// nothing by itself.
+
+// Every verb either protocol understands; anything else is UNKNOWN
+enum class Verb {
+    UNKNOWN,
+    HELO, EHLO, MAIL, RCPT, DATA, RSET, NOOP, QUIT,
+    USER, PASS, STAT, LIST, UIDL, TOP, RETR, DELE, XSUMMARY, XSEARCH,
+    NUM_VERBS
+};
+
+constexpr const char *VERB_NAMES[] = {
+    "",
+    "HELO", "EHLO", "MAIL", "RCPT", "DATA", "RSET", "NOOP", "QUIT",
+    "USER", "PASS", "STAT", "LIST", "UIDL", "TOP", "RETR", "DELE", "XSUMMARY", "XSEARCH"};
+static_assert(sizeof(VERB_NAMES) / sizeof(VERB_NAMES[0]) == (size_t)Verb::NUM_VERBS, "one name per verb");
+
+// Lower case for letters, which is all verbs are made of
+constexpr unsigned char fold_case(char c) { return (unsigned char)c | 0x20; }
+
+// Hash of a verb of at least three letters, ignoring case. It is perfect for
+// the verbs above (checked below), so a lookup is one probe and one compare.
+const size_t VERB_SLOTS = 32;
+constexpr size_t verb_hash(const char *verb, size_t len) {
+    return (fold_case(verb[0]) + 4 * fold_case(verb[1]) + 5 * fold_case(verb[2]) + len) % VERB_SLOTS;
+}
+
+struct VerbTable {
+    Verb slots[VERB_SLOTS] = {};
+    bool perfect = true;
+};
+
+constexpr VerbTable make_verb_table() {
+    VerbTable table;
+    for (size_t i = 1; i < (size_t)Verb::NUM_VERBS; ++i) {
+        size_t len = 0;
+        while (VERB_NAMES[i][len]) ++len;
+        Verb &slot = table.slots[verb_hash(VERB_NAMES[i], len)];
+        if (slot != Verb::UNKNOWN) table.perfect = false;
+        slot = (Verb)i;
+    }
+    return table;
+}
+
+constexpr VerbTable VERB_TABLE = make_verb_table();
+static_assert(VERB_TABLE.perfect, "verb_hash collides; change its multipliers");
+
+inline Verb lookup_verb(std::string_view word) {
+    if (word.size() < 3) return Verb::UNKNOWN;
+    Verb verb = VERB_TABLE.slots[verb_hash(word.data(), word.size())];
+    const char *name = VERB_NAMES[(size_t)verb];
+    for (size_t i = 0; i < word.size(); ++i) {
+        if (!name[i] || fold_case(word[i]) != fold_case(name[i])) return Verb::UNKNOWN;
+    }
+    return name[word.size()] ? Verb::UNKNOWN : verb;
+}
+
+struct Command {
+    Verb verb = Verb::UNKNOWN;
+    std::string_view argument;  // Everything after the first space, trailing blanks removed
+};
+
+// The views in the result point into 'line'
+inline Command parse_command(std::string_view line) {
+    Command command;
+    size_t end = line.find_last_not_of(" \t\r\n");
+    line = line.substr(0, end == std::string_view::npos ? 0 : end + 1);
+    size_t space = line.find(' ');
+    command.verb = lookup_verb(line.substr(0, space));
+    if (space != std::string_view::npos) {
+        command.argument = line.substr(line.find_first_not_of(' ', space));
+    }
+    return command;
+}
+
+// The address in a MAIL/RCPT argument such as "FROM:<a@b>" or "TO: a@b",
+// without angle brackets. 'keyword' is matched case-insensitively; an
+// argument that does not start with it gives an empty string.
+inline std::string_view parse_path(std::string_view argument, const char *keyword) {
+    size_t len = strlen(keyword);
+    if (argument.size() < len || strncasecmp(argument.data(), keyword, len) != 0) return {};
+    size_t start = argument.find_first_not_of(' ', len);
+    if (start == std::string_view::npos) return {};
+    if (argument[start] == '<') {
+        size_t close = argument.find('>', start);
+        if (close == std::string_view::npos) return {};
+        return argument.substr(start + 1, close - start - 1);
+    }
+    return argument.substr(start, argument.find(' ', start) - start);
+}
+
+// Whether an address can name a mailbox. Stores join it into file paths, so
+// a '/' or NUL, or a leading '.' (".", "..", hidden files), is refused here,
+// at RCPT and USER, before any store sees it.
+inline bool valid_mailbox_name(std::string_view mailbox) {
+    if (mailbox.empty() || mailbox[0] == '.') return false;
+    return mailbox.find_first_of(std::string_view("/\0", 2)) == std::string_view::npos;
+}
+
+// Take a decimal number off the front of 'text', and the spaces after it.
+// Arguments are views, not C strings, so atoi() and friends cannot be used.
+inline bool take_number(std::string_view &text, long long &value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc()) return false;
+    text.remove_prefix(result.ptr - text.data());
+    while (!text.empty() && text[0] == ' ') text.remove_prefix(1);
+    return true;
+}
+
+// --- Envelope ---
+
+// Sender and recipients of one SMTP transaction, packed into one buffer that
+// keeps its memory across transactions: once a session has seen its largest
+// envelope, MAIL and RCPT no longer allocate.
+class Envelope {
+public:
+    void clear() {
+        bytes.clear();
+        spans.clear();
+        sender_length = 0;
+        sender_set = false;
+    }
+
+    // Start a new transaction from an accepted MAIL
+    void set_sender(std::string_view sender) {
+        clear();
+        bytes.append(sender.data(), sender.size());
+        sender_length = sender.size();
+        sender_set = true;
+    }
+
+    // Whether MAIL was accepted; the null sender <> counts
+    bool has_sender() const { return sender_set; }
+
+    // Add a recipient named by RCPT; naming one twice adds it once
+    void add_recipient(std::string_view mailbox) {
+        for (size_t i = 0; i < spans.size(); ++i) {
+            if (recipient(i) == mailbox) return;
+        }
+        spans.emplace_back(bytes.size(), mailbox.size());
+        bytes.append(mailbox.data(), mailbox.size());
+    }
+
+    std::string_view sender() const { return std::string_view(bytes.data(), sender_length); }
+    size_t recipients() const { return spans.size(); }
+    std::string_view recipient(size_t i) const {
+        return std::string_view(bytes.data() + spans[i].first, spans[i].second);
+    }
+
+private:
+    std::string bytes;  // The sender, then each recipient
+    std::vector<std::pair<size_t, size_t>> spans;  // Offset and length of each recipient
+    size_t sender_length = 0;
+    bool sender_set = false;
+};
+
+// --- Replies ---
+
+enum class ReplyKind {
+    SMTP,           // "250 text", possibly after "250-text" continuation lines
+    POP3,           // "+OK text" or "-ERR text"
+    POP3_MULTILINE  // A POP3 status line and, after +OK, lines up to a lone dot
+};
+
+struct Reply {
+    int code = 0;      // SMTP reply code; POP3: 1 for +OK, 0 for -ERR
+    std::string text;  // Status text after the code (SMTP: the last line)
+    std::string body;  // Multi-line body, unstuffed, each line ending in LF
+    bool ok() const { return code == 1 || (code >= 200 && code < 400); }
+};
+
+// Assembles one reply at a time from framed lines. Set what is expected
+// with expect(), then feed lines until add_line() reports the reply done.
+class ReplyDecoder {
+public:
+    // 'keep_body' false counts a multi-line body's bytes without storing them
+    void expect(ReplyKind next, bool keep_body = true) {
+        kind = next;
+        keep = keep_body;
+        in_body = false;
+        reply = Reply();
+        body_bytes = 0;
+    }
+
+    // Feed the next line; true once 'reply' holds a complete reply
+    bool add_line(const std::string &line) {
+        if (in_body) {
+            if (line == ".") return true;
+            body_bytes += line.size() + 2;
+            if (keep) {
+                append_unstuffed_line(reply.body, line);
+                reply.body += '\n';
+            }
+            return false;
+        }
+        if (kind == ReplyKind::SMTP) {
+            reply.code = atoi(line.substr(0, 3).c_str());
+            reply.text = line.size() > 4 ? line.substr(4) : "";
+            return !(line.size() > 3 && line[3] == '-');
+        }
+        reply.code = line.compare(0, 3, "+OK") == 0 ? 1 : 0;
+        size_t space = line.find(' ');
+        reply.text = space == std::string::npos ? "" : line.substr(space + 1);
+        in_body = kind == ReplyKind::POP3_MULTILINE && reply.code == 1;
+        return !in_body;
+    }
+
+    // Inside a multi-line body, where add_lines() may be used
+    bool reading_body() const { return in_body; }
+
+    // Feed a block of body lines from LineFramer::next_lines() with lead '.':
+    // whole CRLF lines, none of them stuffed or the final dot
+    void add_lines(std::string_view block) {
+        body_bytes += block.size();
+        if (!keep) return;
+        // Copy the block with each CRLF turned into LF, straight into the body
+        size_t size = reply.body.size();
+        reply.body.resize(size + block.size());
+        char *out = &reply.body[size];
+        const char *line = block.data(), *end = block.data() + block.size();
+        while (line < end) {
+            const char *eol = (const char *)memchr(line, '\n', end - line);
+            memcpy(out, line, eol - 1 - line);
+            out += eol - 1 - line;
+            *out++ = '\n';
+            line = eol + 1;
+        }
+        reply.body.resize(out - reply.body.data());
+    }
+
+    Reply reply;
+    size_t body_bytes = 0;  // Wire size of the multi-line body so far
+
+private:
+    ReplyKind kind = ReplyKind::SMTP;
+    bool keep = true;
+    bool in_body = false;
+};
+
+// Run the lines buffered in 'framer' through 'decoder' until a reply is
+// complete (true) or more bytes are needed (false). Runs of body lines that
+// need no unstuffing go through in blocks rather than one line at a time.
+inline bool decode_reply(LineFramer &framer, ReplyDecoder &decoder) {
+    std::string line;
+    std::string_view block;
+    while (true) {
+        if (decoder.reading_body() && framer.next_lines(block, '.')) {
+            decoder.add_lines(block);
+        } else if (!framer.next_line(line)) {
+            return false;
+        } else if (decoder.add_line(line)) {
+            return true;
+        }
+    }
+}
+
+#endif
@@ -3,373 +3,5453 @@
 #include <fstream>
 #include <sstream>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
 #include <thread>
 #include <vector>
-#include <algorithm> 
+#include <memory>
+#include <unordered_map>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <future>
+#include <iterator>
+#include <zlib.h>
+
+#include "codec.h"
 
 using namespace std;
 
-// --- Helper Functions ---
+// --- Logging ---
+//
+// Log calls never block a session. Each thread formats its records straight
+// into its own single-producer ring buffer, and one background thread drains
+// all rings to stdout. If the sink falls behind and a ring fills up, new
+// records are dropped and counted instead of waiting. Per-command tracing is
+// at TRACE level and compiled down to a single comparison when disabled.
+
+enum class LogLevel { ERROR, WARN, INFO, DEBUG, TRACE };
+
+const char *LOG_LEVEL_NAMES[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+// Set once at startup with --log-level
+LogLevel log_level = LogLevel::INFO;
+
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= log_level) log_write((level), __VA_ARGS__); \
+    } while (0)
+
+struct LogRecord {
+    uint64_t time_us;
+    LogLevel level;
+    char text[244];
+};
+
+// Lock-free ring written by one thread and read by the drain thread
+struct LogRing {
+    static const uint64_t CAPACITY = 1024;  // Power of two
+    LogRecord records[CAPACITY];
+    atomic<uint64_t> head{0};     // Next record to drain
+    atomic<uint64_t> tail{0};     // Next slot to fill
+    atomic<uint64_t> dropped{0};  // Records lost because the ring was full
+};
+
+class Logger {
+public:
+    Logger() {
+        thread(&Logger::run, this).detach();
+    }
+
+    // The calling thread's ring, registered on first use
+    LogRing &ring() {
+        thread_local LogRing *mine = nullptr;
+        if (!mine) {
+            mine = new LogRing;
+            lock_guard<mutex> guard(rings_lock);
+            rings.push_back(mine);
+        }
+        return *mine;
+    }
+
+    // Write out everything logged so far (used before exiting)
+    void flush() {
+        lock_guard<mutex> guard(drain_lock);
+        drain();
+    }
+
+private:
+    mutex rings_lock;
+    vector<LogRing *> rings;  // Rings live as long as the process
+    mutex drain_lock;
+    string out;
+
+    void run() {
+        while (true) {
+            bool busy;
+            {
+                lock_guard<mutex> guard(drain_lock);
+                busy = drain();
+            }
+            if (!busy) this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+
+    bool drain() {
+        vector<LogRing *> current;
+        {
+            lock_guard<mutex> guard(rings_lock);
+            current = rings;
+        }
+
+        for (LogRing *ring : current) {
+            uint64_t head = ring->head.load(memory_order_relaxed);
+            uint64_t tail = ring->tail.load(memory_order_acquire);
+            for (; head != tail; ++head) {
+                format(ring->records[head & (LogRing::CAPACITY - 1)]);
+            }
+            ring->head.store(head, memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+            if (dropped > 0) {
+                out += "[log] " + to_string(dropped) + " records dropped\n";
+            }
+        }
+
+        if (out.empty()) return false;
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        out.clear();
+        return true;
+    }
+
+    void format(const LogRecord &record) {
+        time_t seconds = record.time_us / 1000000;
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        char stamp[48];
+        size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(stamp + n, sizeof(stamp) - n, ".%06llu %-5s ",
+                 (unsigned long long)(record.time_us % 1000000),
+                 LOG_LEVEL_NAMES[(int)record.level]);
+        out += stamp;
+        out += record.text;
+        out += '\n';
+    }
+};
+
+Logger &logger() {
+    static Logger instance;
+    return instance;
+}
+
+// Format a record into the calling thread's ring; use the LOG macro instead
+__attribute__((format(printf, 2, 3)))
+void log_write(LogLevel level, const char *fmt, ...) {
+    LogRing &ring = logger().ring();
+    uint64_t tail = ring.tail.load(memory_order_relaxed);
+    if (tail - ring.head.load(memory_order_acquire) >= LogRing::CAPACITY) {
+        ring.dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord &record = ring.records[tail & (LogRing::CAPACITY - 1)];
+    record.time_us = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    record.level = level;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record.text, sizeof(record.text), fmt, args);
+    va_end(args);
+    ring.tail.store(tail + 1, memory_order_release);
+}
+
+// --- Metrics ---
+//
+// Counters and latency histograms live in per-thread blocks, each on its own
+// cache lines, so recording a sample is an uncontended relaxed add. A scrape
+// sums the blocks of all threads and renders Prometheus text, served on the
+// admin port (--metrics-port) and/or rewritten periodically to a file
+// (--metrics-file).
+
+constexpr const char *SMTP_VERBS[] = {"HELO", "EHLO", "MAIL", "RCPT", "DATA", "RSET", "NOOP", "QUIT", "OTHER"};
+constexpr const char *POP3_VERBS[] = {"USER", "PASS", "STAT", "LIST", "UIDL", "RETR", "TOP", "DELE", "RSET",
+                                      "XSUMMARY", "XSEARCH", "QUIT", "OTHER"};
+const size_t NUM_SMTP_VERBS = sizeof(SMTP_VERBS) / sizeof(SMTP_VERBS[0]);
+const size_t NUM_POP3_VERBS = sizeof(POP3_VERBS) / sizeof(POP3_VERBS[0]);
+
+enum class Protocol { SMTP, POP3 };
+
+enum Counter {
+    SMTP_ACCEPTED,
+    SMTP_CLOSED,
+    POP3_ACCEPTED,
+    POP3_CLOSED,
+    BYTES_RECEIVED,
+    BYTES_SENT,
+    MESSAGES_DELIVERED,
+    DELIVERY_FAILURES,
+    COMMIT_BATCHES,
+    SMTP_REJECTED,      // Turned away at accept: too many sessions or no file descriptors
+    POP3_REJECTED,
+    SESSION_TIMEOUTS,   // Closed for idling past the timeout of their state
+    SLOW_EVICTIONS,     // Closed for sending DATA below --min-data-rate
+    MESSAGES_INDEXED,
+    MESSAGES_DELETED,   // Removed by POP3 sessions at QUIT
+    COMPACTIONS,        // Mailboxes rewritten without their removed messages
+    IO_URING_ENTERS,    // io_uring_enter calls, each submitting and/or reaping a batch
+    IO_URING_COMPLETIONS,
+    SOCKET_WRITES,      // sendmsg/sendfile calls, or io_uring sends, carrying client output
+    HANDLER_ALLOCATIONS, // Heap allocations inside the protocol handlers (COUNT_ALLOCATIONS builds)
+    SMTP_COMMANDS,                                  // One counter per SMTP_VERBS entry
+    POP3_COMMANDS = SMTP_COMMANDS + NUM_SMTP_VERBS, // One counter per POP3_VERBS entry
+    NUM_COUNTERS = POP3_COMMANDS + NUM_POP3_VERBS
+};
+
+enum Histogram {
+    SMTP_TRANSACTION,  // HELO (or the previous transaction's end) to the 250 after DATA
+    SMTP_COMMIT,       // Final dot of DATA to durable
+    POP3_RETR,         // RETR received to the last byte handed to the kernel
+    MAILBOX_LOAD,      // Reading a mailbox listing from the store
+    INDEX_BUILD,       // Indexing one batch of delivered messages for search
+    SEARCH_QUERY,      // Answering one XSEARCH
+    COMPACTION,        // Rewriting one mailbox without its removed messages
+    NUM_HISTOGRAMS
+};
+
+const char *HISTOGRAM_NAMES[] = {
+    "mail_smtp_transaction_seconds", "mail_smtp_commit_seconds",
+    "mail_pop3_retr_seconds", "mail_mailbox_load_seconds",
+    "mail_index_build_seconds", "mail_search_seconds", "mail_compaction_seconds"};
+const char *HISTOGRAM_HELP[] = {
+    "SMTP transaction latency from HELO to the 250 reply after DATA",
+    "Time from the end of DATA until the message is durable",
+    "POP3 RETR latency until the whole message has been written",
+    "Time to read a mailbox listing from the store",
+    "Time to add one batch of delivered messages to a mailbox's search index",
+    "Time to answer one search query",
+    "Time to rewrite one mailbox without its deleted messages"};
+
+// Bucket i counts samples below 2^i microseconds; the last one is +Inf
+const int HISTOGRAM_BUCKETS = 32;
+
+struct alignas(64) ThreadMetrics {
+    atomic<uint64_t> counters[NUM_COUNTERS] = {};
+    atomic<uint64_t> buckets[NUM_HISTOGRAMS][HISTOGRAM_BUCKETS] = {};
+    atomic<uint64_t> sum_us[NUM_HISTOGRAMS] = {};
+};
+
+mutex metrics_lock;
+vector<ThreadMetrics *> all_metrics;  // Blocks live as long as the process
+
+ThreadMetrics &thread_metrics() {
+    thread_local ThreadMetrics *mine = nullptr;
+    if (!mine) {
+        mine = new ThreadMetrics;
+        lock_guard<mutex> guard(metrics_lock);
+        all_metrics.push_back(mine);
+    }
+    return *mine;
+}
+
+// Only the owning thread writes its block, so a plain load/store is enough
+inline void bump(atomic<uint64_t> &value, uint64_t by) {
+    value.store(value.load(memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+inline void count(Counter counter, uint64_t by = 1) {
+    bump(thread_metrics().counters[counter], by);
+}
+
+uint64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void observe(Histogram histogram, uint64_t micros) {
+    ThreadMetrics &metrics = thread_metrics();
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && micros >= (1ull << bucket)) ++bucket;
+    bump(metrics.buckets[histogram][bucket], 1);
+    bump(metrics.sum_us[histogram], micros);
+}
+
+// The command counter of each verb, per protocol, worked out at compile time.
+// A verb the protocol does not have counts as OTHER.
+struct CommandCounters {
+    Counter counter[2][(size_t)Verb::NUM_VERBS] = {};
+};
+
+constexpr bool same_name(const char *a, const char *b) {
+    while (*a && *a == *b) ++a, ++b;
+    return *a == *b;
+}
+
+constexpr CommandCounters make_command_counters() {
+    CommandCounters counters;
+    for (size_t verb = 0; verb < (size_t)Verb::NUM_VERBS; ++verb) {
+        size_t i = 0;
+        while (i < NUM_SMTP_VERBS - 1 && !same_name(SMTP_VERBS[i], VERB_NAMES[verb])) ++i;
+        counters.counter[(int)Protocol::SMTP][verb] = (Counter)(SMTP_COMMANDS + i);
+        i = 0;
+        while (i < NUM_POP3_VERBS - 1 && !same_name(POP3_VERBS[i], VERB_NAMES[verb])) ++i;
+        counters.counter[(int)Protocol::POP3][verb] = (Counter)(POP3_COMMANDS + i);
+    }
+    return counters;
+}
+
+constexpr CommandCounters COMMAND_COUNTERS = make_command_counters();
+
+void count_command(Protocol protocol, Verb verb) {
+    count(COMMAND_COUNTERS.counter[(int)protocol][(size_t)verb]);
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Built with -DCOUNT_ALLOCATIONS (make server_alloc_app): every heap
+// allocation is counted per thread, and the event loop adds up the ones made
+// while a command is handled (mail_handler_allocations_total)
+thread_local uint64_t thread_allocations = 0;
+
+void *operator new(size_t size) {
+    ++thread_allocations;
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+
+// --- io_uring ---
+//
+// With the io_uring backend (--io-backend, picked at startup) each event loop
+// and each delivery shard owns a ring. An event loop queues its socket
+// operations (multishot accepts, multishot receives into a ring of buffers
+// registered with the kernel, sends and reads of message files for RETR) and
+// submits them all while waiting for completions, so one system call per
+// loop iteration replaces a recv() and a send() per session. A delivery shard
+// submits a group commit's writes and syncs together. The ring is driven
+// straight through the kernel interface; no library is needed.
+
+enum class IoBackend { EPOLL, URING };
+IoBackend io_backend = IoBackend::EPOLL;  // Set in main()
+
+class IoUring {
+public:
+    ~IoUring() {
+        if (buffer_ring) munmap(buffer_ring, buffer_ring_bytes);
+        if (buffers) munmap(buffers, (size_t)buffer_count * buffer_size);
+        if (sqes) munmap(sqes, sqes_bytes);
+        if (rings) munmap(rings, rings_bytes);
+        if (fd >= 0) close(fd);
+    }
+
+    // Room for 'entries' queued operations and four times as many completions
+    bool open(unsigned entries, string &error) {
+        struct io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 4;
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0 && errno == EINVAL) {
+            // Cooperative task running came with Linux 5.19
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (fd < 0) {
+            error = strerror(errno);
+            return false;
+        }
+        unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            error = "kernel lacks the required io_uring features";
+            return false;
+        }
+
+        // The submission and completion rings share one mapping
+        rings_bytes = max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        rings = mmap(nullptr, rings_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+        sqes = (struct io_uring_sqe *)mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+            if (rings == MAP_FAILED) rings = nullptr;
+            if (sqes == MAP_FAILED) sqes = nullptr;
+            error = strerror(errno);
+            return false;
+        }
+        char *base = (char *)rings;
+        sq_head = (uint32_t *)(base + params.sq_off.head);
+        sq_tail = (uint32_t *)(base + params.sq_off.tail);
+        sq_mask = *(uint32_t *)(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = (uint32_t *)(base + params.cq_off.head);
+        cq_tail = (uint32_t *)(base + params.cq_off.tail);
+        cq_mask = *(uint32_t *)(base + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+        uint32_t *array = (uint32_t *)(base + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) {
+            array[i] = i;
+        }
+        tail = *sq_tail;
+        return true;
+    }
+
+    // Whether the kernel implements an operation
+    bool supports(uint8_t op) {
+        size_t bytes = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        vector<char> storage(bytes);
+        struct io_uring_probe *probe = (struct io_uring_probe *)storage.data();
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // A cleared submission slot, or null if the queue stays full even after
+    // submitting what is in it
+    struct io_uring_sqe *next_sqe() {
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit();
+            if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return nullptr;
+        }
+        struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        ++tail;
+        ++queued;
+        return sqe;
+    }
+
+    bool has_queued() const { return queued > 0; }
+
+    // Hand every queued operation to the kernel and, if 'wait' is set, block
+    // until that many completions are ready or 'timeout_ms' passes (-1: no
+    // limit). Returns the number submitted or -errno.
+    int submit(unsigned wait = 0, int timeout_ms = -1) {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        struct __kernel_timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000ll};
+        struct io_uring_getevents_arg arg = {};
+        if (timeout_ms >= 0) arg.ts = (uint64_t)&timeout;
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+        int submitted = syscall(__NR_io_uring_enter, fd, queued, wait, flags, wait ? &arg : nullptr,
+                                wait ? sizeof(arg) : 0);
+        count(IO_URING_ENTERS);
+        if (submitted < 0) return -errno;
+        queued -= min((unsigned)submitted, queued);
+        return submitted;
+    }
+
+    // Pass every completion that has arrived to 'handle', oldest first. Each
+    // slot is handed back before its handler runs, so handlers may queue more.
+    template <typename Handler>
+    void reap(Handler handle) {
+        uint32_t head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            count(IO_URING_COMPLETIONS);
+            handle(cqe);
+        }
+    }
+
+    // Register 'count' (a power of two) receive buffers of 'size' bytes as
+    // buffer group 'group'. Receives that select from the group take a
+    // buffer only once data arrives, so idle sockets hold none.
+    bool provide_buffers(uint16_t group, unsigned count, unsigned size) {
+        buffer_ring_bytes = count * sizeof(struct io_uring_buf);
+        void *ring = mmap(nullptr, buffer_ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *memory = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED || memory == MAP_FAILED) {
+            if (ring != MAP_FAILED) munmap(ring, buffer_ring_bytes);
+            if (memory != MAP_FAILED) munmap(memory, (size_t)count * size);
+            return false;
+        }
+        buffer_ring = (struct io_uring_buf *)ring;
+        buffers = (char *)memory;
+        buffer_count = count;
+        buffer_size = size;
+        struct io_uring_buf_reg reg = {};
+        reg.ring_addr = (uint64_t)buffer_ring;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+        for (unsigned id = 0; id < count; ++id) {
+            recycle(id);
+        }
+        return true;
+    }
+
+    char *buffer(uint16_t id) { return buffers + (size_t)id * buffer_size; }
+
+    // Give a receive buffer back to the kernel once its bytes are consumed.
+    // The ring's tail overlays the reserved field of its first entry (struct
+    // io_uring_buf_ring, whose flexible array C++ lays out differently).
+    void recycle(uint16_t id) {
+        struct io_uring_buf &slot = buffer_ring[buffer_tail & (buffer_count - 1)];
+        slot.addr = (uint64_t)buffer(id);
+        slot.len = buffer_size;
+        slot.bid = id;
+        __atomic_store_n(&buffer_ring[0].resv, ++buffer_tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    int fd = -1;
+    void *rings = nullptr;
+    size_t rings_bytes = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_bytes = 0;
+    uint32_t *sq_head = nullptr, *sq_tail = nullptr;
+    uint32_t sq_mask = 0, sq_entries = 0;
+    uint32_t tail = 0;    // Our copy of the submission tail, published on submit()
+    unsigned queued = 0;  // Filled slots not yet submitted
+    uint32_t *cq_head = nullptr, *cq_tail = nullptr;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+    struct io_uring_buf *buffer_ring = nullptr;
+    size_t buffer_ring_bytes = 0;
+    char *buffers = nullptr;
+    unsigned buffer_count = 0, buffer_size = 0;
+    uint16_t buffer_tail = 0;
+};
+
+// Whether this kernel (and sandbox) can run the io_uring backend: it needs
+// multishot receive, which arrived with zero-copy send in Linux 6.0
+bool io_uring_usable(string &reason) {
+    IoUring ring;
+    if (!ring.open(8, reason)) return false;
+    for (uint8_t op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE,
+                       IORING_OP_FSYNC, IORING_OP_POLL_ADD, IORING_OP_SEND_ZC}) {
+        if (!ring.supports(op)) {
+            reason = "kernel older than 6.0";
+            return false;
+        }
+    }
+    if (!ring.provide_buffers(0, 1, 4096)) {
+        reason = "cannot register receive buffers";
+        return false;
+    }
+    return true;
+}
+
+// The calling thread's ring for file I/O, or null with the epoll backend
+IoUring *file_ring() {
+    thread_local unique_ptr<IoUring> ring;
+    thread_local bool tried = false;
+    if (!tried && io_backend == IoBackend::URING) {
+        tried = true;
+        string error;
+        ring.reset(new IoUring);
+        if (!ring->open(16, error)) {
+            LOG(LogLevel::WARN, "io_uring for file writes unavailable: %s", error.c_str());
+            ring.reset();
+        }
+    }
+    return ring.get();
+}
+
+
+// Storage sits behind the MailStore interface so the engine can be chosen at
+// startup (--store). Delivery appends through a MailboxWriter, of which each
+// delivery shard owns one, and POP3 sessions work from a listing of the
+// mailbox's messages taken at login. Every engine stores messages wire-ready
+// (CRLF lines, dot-stuffed as received in DATA) so RETR can hand the stored
+// bytes straight to sendfile().
+
+// What a listing knows about one stored message
+struct MessageMeta {
+    uint64_t octets;  // Size on the wire, as reported by STAT/LIST
+    uint64_t offset;  // Where the stored bytes start (flat: offset in <user>.txt)
+    uint64_t length;  // Stored length
+    string name;      // Engine-specific key (maildir: path of the message file)
+    uint64_t uid;     // Never reused within the mailbox and never changes (UIDL)
+    uint64_t slot = 0; // Position in the store's index (flat, packed), which tombstones refer to
+};
+
+// Where the wire bytes of one message can be read from
+struct MessageSource {
+    int fd = -1;          // File to send from, or -1 if the bytes are in memory
+    bool owns_fd = false; // The reader must close 'fd' once it is sent
+    off_t offset = 0;
+    size_t length = 0;
+    shared_ptr<const string> data;  // In-memory bytes when fd < 0
+};
+
+class MessageBody;
+struct MessageSummary;
+
+// Appends to mailboxes. A writer is used by one thread only, and a given
+// mailbox is always appended to through the same writer.
+class MailboxWriter {
+public:
+    virtual ~MailboxWriter() = default;
+    // Durably append messages to one mailbox, all or nothing. On success
+    // 'added' describes the new messages in order.
+    virtual bool append(const string &mailbox, const vector<MessageBody *> &messages,
+                        vector<MessageMeta> &added) = 0;
+    // Close any files held for a mailbox whose files were replaced
+    virtual void forget(const string &) {}
+    // Bring the files kept for a mailbox up to date with its messages, for
+    // a reader that found its index behind
+    virtual bool catch_up(const string &) { return true; }
+};
+
+// A mailbox being rewritten without its removed messages. copy() does the
+// bulk of the work on the compactor's thread while deliveries go on;
+// finish() runs on the thread of the mailbox's writer, between appends, to
+// copy whatever arrived meanwhile and swap the new files in.
+class Compaction {
+public:
+    virtual ~Compaction() = default;
+    virtual bool copy() = 0;
+    virtual bool finish(MailboxWriter &writer) = 0;
+    // For the log: messages and bytes before and after
+    size_t messages_before = 0, messages_after = 0;
+    uint64_t bytes_before = 0, bytes_after = 0;
+};
+
+class MailStore {
+public:
+    virtual ~MailStore() = default;
+    virtual const char *name() const = 0;
+    virtual unique_ptr<MailboxWriter> new_writer() = 0;
+    // Read the list of messages in a mailbox, oldest first
+    virtual vector<MessageMeta> load_listing(const string &mailbox) = 0;
+    virtual bool open_message(const string &mailbox, const MessageMeta &meta, MessageSource &source) = 0;
+    // The header index of a mailbox, keyed by UID
+    virtual unordered_map<uint64_t, MessageSummary> load_summaries(const string &mailbox) = 0;
+    // Durably remove messages a POP3 session deleted (its UPDATE state).
+    // Called on the mailbox's writer thread; later listings leave them out.
+    virtual bool remove_messages(const string &mailbox, const vector<MessageMeta> &doomed) = 0;
+    // A rewrite of the mailbox without its removed messages, or null when
+    // they are less than 'threshold' of everything stored
+    virtual unique_ptr<Compaction> plan_compaction(const string &, double) { return nullptr; }
+};
+
+// Have the writer of a mailbox catch up on its index (defined with the
+// delivery writers): readers never write an index themselves
+void catch_up_mailbox(const string &mailbox);
+
+// Write the whole buffer, retrying on short writes
+bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Write the whole buffer at 'offset'
+bool pwrite_all(int fd, const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// One range of a group commit
+struct FileWrite {
+    int fd;
+    const char *data;
+    size_t length;
+    uint64_t offset;
+};
+
+// Write every range and fdatasync its file. With io_uring each write is
+// linked to its sync and the whole group goes to the kernel in one call, so
+// the files are synced in parallel rather than one after the other.
+bool write_durably(const vector<FileWrite> &writes) {
+    IoUring *ring = file_ring();
+    if (!ring) {
+        for (const FileWrite &write : writes) {
+            if (!pwrite_all(write.fd, write.data, write.length, write.offset)) return false;
+        }
+        for (const FileWrite &write : writes) {
+            if (fdatasync(write.fd) != 0) return false;
+        }
+        return true;
+    }
+
+    unsigned operations = 0;
+    for (size_t i = 0; i < writes.size(); ++i) {
+        struct io_uring_sqe *sqe = ring->next_sqe();
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = writes[i].fd;
+        sqe->addr = (uint64_t)writes[i].data;
+        sqe->len = writes[i].length;
+        sqe->off = writes[i].offset;
+        sqe->flags = IOSQE_IO_LINK;  // A failed or short write cancels the sync
+        sqe->user_data = i;
+        ++operations;
+        if (!(sqe = ring->next_sqe())) break;
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = writes[i].fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = writes.size() + i;
+        ++operations;
+    }
+    bool ok = operations == 2 * writes.size();
+    unsigned completed = 0;
+    while (completed < operations) {
+        int submitted = ring->submit(operations - completed);
+        if (submitted < 0 && submitted != -EINTR && submitted != -EAGAIN && submitted != -EBUSY) {
+            LOG(LogLevel::ERROR, "io_uring_enter: %s", strerror(-submitted));
+            return false;
+        }
+        ring->reap([&](const struct io_uring_cqe &cqe) {
+            ++completed;
+            bool is_write = cqe.user_data < writes.size();
+            if (is_write ? cqe.res != (int)writes[cqe.user_data].length : cqe.res != 0) ok = false;
+        });
+    }
+    return ok;
+}
+
+// Copy 'length' bytes from 'in' at 'in_pos' to 'out' at 'out_pos', file to
+// file in the kernel where the filesystem allows it
+bool copy_range(int in, uint64_t in_pos, uint64_t length, int out, uint64_t out_pos) {
+    loff_t from = in_pos, to = out_pos;
+    uint64_t end = in_pos + length;
+    while ((uint64_t)from < end) {
+        ssize_t n = copy_file_range(in, &from, out, &to, end - from, 0);
+        if (n <= 0) break;
+    }
+    // Filesystems without copy_file_range: go through a fixed buffer
+    char buffer[65536];
+    while ((uint64_t)from < end) {
+        ssize_t n = pread(in, buffer, min<uint64_t>(sizeof(buffer), end - from), from);
+        if (n <= 0 || !pwrite_all(out, buffer, n, to)) return false;
+        from += n;
+        to += n;
+    }
+    return true;
+}
+
+// Make a directory's entries (new or renamed files) durable
+void sync_directory(const string &path) {
+    int dir = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+// Messages must end in CRLF so the POP3 terminator lands on its own line
+bool needs_final_crlf(const string &content) {
+    return content.empty() || content.back() != '\n';
+}
+
+// Where DATA too big to buffer in memory is written as it arrives; also holds
+// the blobs of shared in-memory bodies. Emptied at startup.
+const string SPOOL_DIR = "spool";
+
+// An id unique across restarts: microseconds since the epoch and a sequence number
+uint64_t unique_id() {
+    static atomic<uint64_t> sequence(0);
+    uint64_t now = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    return (now << 12) | (sequence++ & 0xfff);
+}
+
+string spool_path(uint64_t id) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)id);
+    return SPOOL_DIR + name;
+}
+
+// Remove spool files left behind by a previous run; nothing references them
+void clear_spool() {
+    mkdir(SPOOL_DIR.c_str(), 0755);
+    DIR *dir = opendir(SPOOL_DIR.c_str());
+    if (!dir) return;
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') unlink((SPOOL_DIR + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+}
+
+// What the header index records about a message
+struct MessageSummary {
+    uint64_t header_length = 0;  // Header block, including the blank line after it
+    string from;
+    string subject;
+};
+
+// Longest From/Subject value kept in a summary
+const size_t MAX_SUMMARY_FIELD = 256;
+
+// Builds a MessageSummary from the lines of a message (wire form, without
+// CRLF), fed in order: while DATA arrives, or from stored bytes
+struct SummaryBuilder {
+    MessageSummary summary;
+    bool in_headers = true;
+    string *field = nullptr;  // Value a folded continuation line extends
+
+    SummaryBuilder() = default;
+    SummaryBuilder(const SummaryBuilder &) = delete;
+    SummaryBuilder &operator=(SummaryBuilder &&other) {
+        summary = move(other.summary);
+        in_headers = other.in_headers;
+        field = nullptr;
+        return *this;
+    }
+
+    void add_line(string_view line) {
+        if (!in_headers) return;
+        summary.header_length += line.size() + 2;
+        if (line.empty()) {
+            in_headers = false;
+            return;
+        }
+        size_t value = 0;
+        if (line[0] == ' ' || line[0] == '\t') {
+            if (!field) return;
+            *field += ' ';
+        } else if (line.size() >= 5 && strncasecmp(line.data(), "From:", 5) == 0) {
+            field = &summary.from;
+            value = 5;
+        } else if (line.size() >= 8 && strncasecmp(line.data(), "Subject:", 8) == 0) {
+            field = &summary.subject;
+            value = 8;
+        } else {
+            field = nullptr;
+            return;
+        }
+        value = line.find_first_not_of(" \t", value);
+        for (size_t i = value; i < line.size() && field->size() < MAX_SUMMARY_FIELD; ++i) {
+            // Tabs separate the fields of an XSUMMARY line
+            *field += line[i] == '\t' ? ' ' : line[i];
+        }
+    }
+};
+
+// The body of one accepted message, shared by the delivery jobs of all its
+// recipients. Small bodies are held in memory; large ones stay in the spool
+// file DATA was streamed into. A body with several recipients is written to
+// disk once, as a blob, and every mailbox gets a hard link to that file
+// instead of a copy: the link count is the reference count, and fan-out costs
+// one write of the body plus a link per recipient.
+class MessageBody {
+public:
+    // A body received into memory
+    MessageBody(string received, size_t recipients)
+        : content(move(received)), recipients(recipients), id(unique_id()) {
+        if (needs_final_crlf(content)) {
+            content += "\r\n";
+        }
+        length = content.size();
+    }
+
+    // A body already in a spool file (wire-ready, ending in CRLF); takes the file over
+    MessageBody(int fd, string path, uint64_t length, size_t recipients)
+        : recipients(recipients), id(unique_id()), length(length), fd(fd), path(move(path)) {}
+
+    // Every recipient holds its own link or copy by now, so the spool name can go
+    ~MessageBody() {
+        if (fd >= 0) close(fd);
+        if (!path.empty()) unlink(path.c_str());
+    }
+
+    MessageSummary summary;  // Captured from the headers as DATA arrived
+
+    bool in_memory() const { return fd < 0 && path.empty(); }
+    const string &bytes() const { return content; }  // Only for in-memory bodies
+    uint64_t size() const { return length; }
+    uint64_t message_id() const { return id; }
+    bool single_instance() const { return recipients > 1; }
+    // A number for the next link to the blob, distinct from all the others
+    uint64_t next_link() { return links++; }
+
+    // Make sure the body is a durable file that can be linked, once; writer
+    // threads delivering other recipients wait here for the first one.
+    // Returns the file's path.
+    bool stage(string &staged_path) {
+        lock_guard<mutex> guard(lock);
+        if (!attempted) {
+            attempted = true;
+            if (in_memory()) {
+                path = spool_path(id);
+                fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                staged = fd >= 0 && write_all(fd, content.data(), content.size()) && fdatasync(fd) == 0;
+            } else {
+                staged = fdatasync(fd) == 0;
+            }
+        }
+        staged_path = path;
+        return staged;
+    }
+
+    // The body in memory, reading it back from the spool if need be; at
+    // most the first 'limit' bytes
+    bool read_all(string &out, uint64_t limit = UINT64_MAX) const {
+        uint64_t want = min(length, limit);
+        if (fd < 0) {
+            out.assign(content, 0, want);
+            return true;
+        }
+        out.resize(want);
+        return pread(fd, &out[0], want, 0) == (ssize_t)want;
+    }
+
+    // Write the body into 'out' at 'offset', copying file to file in the
+    // kernel when it is spooled
+    bool copy_to(int out, uint64_t offset) const {
+        if (fd < 0) return pwrite_all(out, content.data(), content.size(), offset);
+        return copy_range(fd, 0, length, out, offset);
+    }
+
+private:
+    string content;     // Wire-ready, ending in CRLF (in-memory bodies)
+    size_t recipients;
+    uint64_t id;        // From unique_id(): names the blob, and is the UID in flat mailboxes
+    uint64_t length;
+    atomic<uint64_t> links{0};
+    mutex lock;
+    bool attempted = false;
+    bool staged = false;
+    int fd = -1;        // Spool file, if the body has one
+    string path;
+};
+
+// --- Header Index ---
+//
+// Each mailbox has a summary file with one record per delivered message: its
+// UID, the length of its header block, and From and Subject. Writers append
+// to it at delivery from what the session captured while DATA streamed in, so
+// TOP and XSUMMARY never re-parse bodies, and an overview of a whole mailbox
+// reads only this file. It is derived data and is not synced: a message it
+// lacks (a tail lost in a crash, or mail from before it existed) is
+// summarized from its stored bytes instead.
+
+const uint32_t SUMMARY_MAGIC = 0x4d55534d;  // "MSUM"
+
+struct SummaryRecord {
+    uint64_t uid;
+    uint64_t header_length;
+    uint16_t from_length;     // Followed by the From, then the Subject bytes
+    uint16_t subject_length;
+    uint32_t reserved;
+};
+
+// Record the summaries of messages just committed to a mailbox
+void append_summaries(const string &path, const vector<const MessageSummary *> &summaries,
+                      const vector<MessageMeta> &added) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    string records;
+    struct stat st = {};
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        records.append((const char *)&SUMMARY_MAGIC, sizeof(SUMMARY_MAGIC));
+    }
+    for (size_t i = 0; i < summaries.size(); ++i) {
+        const MessageSummary &summary = *summaries[i];
+        SummaryRecord record = {added[i].uid, summary.header_length, (uint16_t)summary.from.size(),
+                                (uint16_t)summary.subject.size(), 0};
+        records.append((const char *)&record, sizeof(record));
+        records += summary.from;
+        records += summary.subject;
+    }
+    write_all(fd, records.data(), records.size());
+    close(fd);
+}
+
+void append_summaries(const string &path, const vector<MessageBody *> &messages,
+                      const vector<MessageMeta> &added) {
+    vector<const MessageSummary *> summaries;
+    for (MessageBody *body : messages) {
+        summaries.push_back(&body->summary);
+    }
+    append_summaries(path, summaries, added);
+}
+
+// Read a summary file, keyed by UID. A torn last record is ignored.
+unordered_map<uint64_t, MessageSummary> load_summaries(const string &path) {
+    unordered_map<uint64_t, MessageSummary> summaries;
+    ifstream infile(path, ios::binary);
+    uint32_t magic = 0;
+    if (!infile.read((char *)&magic, sizeof(magic)) || magic != SUMMARY_MAGIC) return summaries;
+    SummaryRecord record;
+    while (infile.read((char *)&record, sizeof(record))) {
+        MessageSummary summary;
+        summary.header_length = record.header_length;
+        summary.from.resize(record.from_length);
+        summary.subject.resize(record.subject_length);
+        if (!infile.read(&summary.from[0], record.from_length) ||
+            !infile.read(&summary.subject[0], record.subject_length)) {
+            break;
+        }
+        summaries[record.uid] = move(summary);
+    }
+    return summaries;
+}
+
+// Rewrite a summary file keeping only the messages in 'live'
+void prune_summaries(const string &path, const vector<uint64_t> &live) {
+    unordered_map<uint64_t, MessageSummary> summaries = load_summaries(path);
+    vector<const MessageSummary *> kept;
+    vector<MessageMeta> kept_meta;
+    for (uint64_t uid : live) {
+        auto it = summaries.find(uid);
+        if (it == summaries.end()) continue;
+        kept.push_back(&it->second);
+        kept_meta.push_back({0, 0, 0, "", uid});
+    }
+    string tmp = path + ".tmp";
+    unlink(tmp.c_str());
+    append_summaries(tmp, kept, kept_meta);
+    rename(tmp.c_str(), path.c_str());
+}
+
+// --- Tombstones ---
+//
+// POP3 deletions take effect when the session quits (its UPDATE state). The
+// flat and packed stores record them as bits in a tombstone bitmap next to
+// the mailbox, indexed by the message's slot in the mailbox index, rather
+// than rewriting the mailbox under the session. Listings skip tombstoned
+// slots; the bytes stay until the compactor rewrites the mailbox once enough
+// of it is dead.
+//
+// A compaction copies the live messages to <data>.compact and rebuilds the
+// index and bitmap for their new offsets and slots. The bulk copy works from
+// a snapshot of the index while deliveries keep appending; finish() then
+// runs on the mailbox's writer thread, copies the tail that arrived since,
+// carries over tombstones set meanwhile and swaps the files in. The swap is
+// crash-safe: a <data>.compacting marker naming the files is made durable
+// first, and recover_compactions() completes an interrupted swap at startup.
+
+const uint32_t TOMBSTONE_MAGIC = 0x4c45444d;  // "MDEL"
+
+const string COMPACT_SUFFIX = ".compact";
+const string COMPACTING_SUFFIX = ".compacting";
+
+class Tombstones {
+public:
+    bool test(uint64_t slot) const {
+        return slot / 8 < bits.size() && ((unsigned char)bits[slot / 8] >> (slot % 8) & 1);
+    }
+    void set(uint64_t slot) {
+        if (slot / 8 >= bits.size()) bits.resize(slot / 8 + 1, '\0');
+        bits[slot / 8] |= 1 << (slot % 8);
+    }
+    // Tombstones among the first 'slots' slots
+    size_t count(uint64_t slots) const {
+        size_t total = 0;
+        for (uint64_t slot = 0; slot < slots && slot / 8 < bits.size(); slot += 8) {
+            unsigned byte = (unsigned char)bits[slot / 8];
+            if (slots - slot < 8) byte &= (1u << (slots - slot)) - 1;
+            total += __builtin_popcount(byte);
+        }
+        return total;
+    }
+
+    string bits;  // Bit i of byte i / 8 is slot i
+};
+
+Tombstones load_tombstones(const string &path) {
+    Tombstones tombstones;
+    ifstream infile(path, ios::binary);
+    uint32_t magic = 0;
+    if (!infile.read((char *)&magic, sizeof(magic)) || magic != TOMBSTONE_MAGIC) return tombstones;
+    tombstones.bits.assign(istreambuf_iterator<char>(infile), istreambuf_iterator<char>());
+    return tombstones;
+}
+
+// Durably add 'slots' to a tombstone file. Only the bytes from the lowest
+// one changed onwards are rewritten.
+bool add_tombstones(const string &path, const vector<uint64_t> &slots) {
+    if (slots.empty()) return true;
+    Tombstones tombstones = load_tombstones(path);
+    uint64_t first = UINT64_MAX;
+    for (uint64_t slot : slots) {
+        tombstones.set(slot);
+        first = min(first, slot / 8);
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st = {};
+    bool created = fstat(fd, &st) == 0 && st.st_size == 0;
+    const string &bits = tombstones.bits;
+    bool ok = (!created || pwrite_all(fd, (const char *)&TOMBSTONE_MAGIC, sizeof(TOMBSTONE_MAGIC), 0)) &&
+              pwrite_all(fd, bits.data() + first, bits.size() - first, sizeof(TOMBSTONE_MAGIC) + first) &&
+              fdatasync(fd) == 0;
+    close(fd);
+    if (ok && created) sync_directory(".");
+    return ok;
+}
+
+// Write a whole tombstone file (not synced)
+bool write_tombstones(int fd, const Tombstones &tombstones) {
+    return write_all(fd, (const char *)&TOMBSTONE_MAGIC, sizeof(TOMBSTONE_MAGIC)) &&
+           write_all(fd, tombstones.bits.data(), tombstones.bits.size());
+}
+
+// The files of a mailbox in a store with an index of fixed-size records
+struct MailboxFiles {
+    string data;        // The messages (<user>.txt, <user>.seg)
+    string index;       // A header, then one record per message
+    string tombstones;
+    string summaries;   // Header index, pruned to the live messages afterwards
+};
+
+// Compaction of a store whose index records have an 'offset' into the data
+// file, with a store-specific record type and layout
+template <typename Record>
+class RecordCompaction : public Compaction {
+public:
+    struct Layout {
+        MailboxFiles files;
+        string header;                                    // Bytes the index starts with
+        function<vector<Record>(const string &)> load;    // The mailbox's index, up to date
+        function<uint64_t(const Record &)> span;          // Bytes stored for a record, from its offset
+        function<void(const Record &)> drop;              // Release what a removed record refers to
+    };
+
+    RecordCompaction(const string &mailbox, Layout layout, vector<Record> records, Tombstones dead)
+        : mailbox(mailbox), layout(move(layout)), snapshot(move(records)), dead(move(dead)) {}
+
+    ~RecordCompaction() {
+        if (out >= 0) close(out);
+        if (!committed) {
+            for (const string &path : {layout.files.data, layout.files.index, layout.files.tombstones}) {
+                unlink((path + COMPACT_SUFFIX).c_str());
+            }
+        }
+    }
+
+    // Copy the messages that were live in the snapshot
+    bool copy() override {
+        int in = open(layout.files.data.c_str(), O_RDONLY | O_CLOEXEC);
+        out = open((layout.files.data + COMPACT_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = in >= 0 && out >= 0;
+        for (size_t i = 0; ok && i < snapshot.size(); ++i) {
+            bytes_before += layout.span(snapshot[i]);
+            if (!dead.test(i)) ok = keep(in, snapshot[i], i);
+        }
+        if (in >= 0) close(in);
+        return ok;
+    }
+
+    bool finish(MailboxWriter &writer) override {
+        vector<Record> current = layout.load(mailbox);
+        Tombstones now = load_tombstones(layout.files.tombstones);
+        if (current.size() < snapshot.size()) return false;  // Replaced underneath us
+
+        // Messages that arrived since the snapshot, and deletions since
+        int in = open(layout.files.data.c_str(), O_RDONLY | O_CLOEXEC);
+        bool ok = in >= 0;
+        for (size_t i = snapshot.size(); ok && i < current.size(); ++i) {
+            bytes_before += layout.span(current[i]);
+            if (!now.test(i)) ok = keep(in, current[i], i);
+        }
+        if (in >= 0) close(in);
+        Tombstones carried;
+        for (size_t i = 0; i < kept.size(); ++i) {
+            if (now.test(kept_slots[i])) carried.set(i);
+        }
+
+        string index = layout.header;
+        index.append((const char *)kept.data(), kept.size() * sizeof(Record));
+        int idx = open((layout.files.index + COMPACT_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int del = open((layout.files.tombstones + COMPACT_SUFFIX).c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = ok && idx >= 0 && del >= 0 && write_all(idx, index.data(), index.size()) &&
+             write_tombstones(del, carried) && fdatasync(out) == 0 && fdatasync(idx) == 0 && fdatasync(del) == 0;
+        if (idx >= 0) close(idx);
+        if (del >= 0) close(del);
+        if (!ok || !commit()) return false;
+
+        writer.forget(mailbox);
+        vector<uint64_t> live;
+        for (const Record &record : kept) {
+            live.push_back(record.uid);
+        }
+        for (size_t i = 0; i < current.size(); ++i) {
+            if (i < snapshot.size() ? dead.test(i) : now.test(i)) layout.drop(current[i]);
+        }
+        prune_summaries(layout.files.summaries, live);
+        messages_before = current.size();
+        messages_after = kept.size();
+        return true;
+    }
+
+private:
+    string mailbox;
+    Layout layout;
+    vector<Record> snapshot;  // The index when the compaction was planned
+    Tombstones dead;          // ...and the tombstones then
+    int out = -1;             // <data>.compact
+    vector<Record> kept;      // Index of the new data file
+    vector<uint64_t> kept_slots;  // Old slot of each kept record
+    bool committed = false;
+
+    bool keep(int in, const Record &record, uint64_t slot) {
+        Record moved = record;
+        moved.offset = bytes_after;
+        uint64_t length = layout.span(record);
+        if (!copy_range(in, record.offset, length, out, bytes_after)) return false;
+        bytes_after += length;
+        kept.push_back(moved);
+        kept_slots.push_back(slot);
+        return true;
+    }
+
+    // Swap the new files in. Once the marker is durable, recovery finishes
+    // the renames if we crash halfway.
+    bool commit() {
+        const MailboxFiles &files = layout.files;
+        string marker = files.data + COMPACTING_SUFFIX;
+        string names = files.data + "\n" + files.index + "\n" + files.tombstones + "\n";
+        int fd = open(marker.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write_all(fd, names.data(), names.size()) && fdatasync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            unlink(marker.c_str());
+            return false;
+        }
+        sync_directory(".");
+        committed = true;
+        for (const string &path : {files.index, files.data, files.tombstones}) {
+            rename((path + COMPACT_SUFFIX).c_str(), path.c_str());
+        }
+        sync_directory(".");
+        unlink(marker.c_str());
+        return true;
+    }
+};
+
+// Finish compactions a crash interrupted after their commit point, and
+// remove the files of those it interrupted before
+void recover_compactions() {
+    DIR *dir = opendir(".");
+    if (!dir) return;
+    vector<string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    auto ends_with = [](const string &name, const string &suffix) {
+        return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    for (const string &name : names) {
+        if (!ends_with(name, COMPACTING_SUFFIX)) continue;
+        ifstream marker(name);
+        string path;
+        while (getline(marker, path)) {
+            if (access((path + COMPACT_SUFFIX).c_str(), F_OK) == 0) {
+                rename((path + COMPACT_SUFFIX).c_str(), path.c_str());
+            }
+        }
+        sync_directory(".");
+        unlink(name.c_str());
+        LOG(LogLevel::WARN, "Finished interrupted compaction of %s",
+            name.substr(0, name.size() - COMPACTING_SUFFIX.size()).c_str());
+    }
+    for (const string &name : names) {
+        if (ends_with(name, COMPACT_SUFFIX) && access(name.c_str(), F_OK) == 0) unlink(name.c_str());
+    }
+}
+
+// --- Flat File Store ---
+//
+// Each mailbox is a flat file <user>.txt holding the messages back to back,
+// each followed by a delimiter line that carries the message's UID (older
+// files use the plain MESSAGE_DELIMITER, and offsets as UIDs). Next to it, <user>.idx is a binary
+// sidecar with one fixed-size IndexRecord per message, so POP3 never has to
+// re-parse the text file: STAT/LIST come from the index and RETR reads only
+// the byte range of the requested message. A message delivered to several
+// recipients is stored once under blobs/; each mailbox then holds a one-line
+// reference to its own hard link of the blob in place of the message text.
+
+// A unique delimiter to split emails within the file
+const string MESSAGE_DELIMITER = "--- END OF MESSAGE ---\n";
+const char *UID_DELIMITER_FORMAT = "--- END OF MESSAGE %016llx ---\n";
+
+const uint32_t INDEX_MAGIC = 0x5844494d;  // "MIDX"
+const uint32_t INDEX_VERSION = 3;
+
+// Shared bodies, and the reference that stands in for one in <user>.txt
+const string BLOB_DIR = "blobs";
+const char *BLOB_REFERENCE_FORMAT = "--- BLOB %016llx.%llu %llu ---";
+
+struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Location and POP3 size of one stored message
+struct IndexRecord {
+    uint64_t offset;  // First byte of the message in <user>.txt
+    uint64_t length;  // Stored length, not including the delimiter
+    uint64_t octets;  // Size on the wire (stored bytes with bare LFs as CRLF)
+    uint64_t blob;    // For a reference: the blob and which link of it; 0 otherwise
+    uint64_t link;
+    uint64_t uid;
+    uint64_t delimiter; // Length of the delimiter line after the message
+};
+
+string mailbox_path(const string& username) {
+    return username + ".txt";
+}
+
+string index_path(const string& username) {
+    return username + ".idx";
+}
+
+string summary_path(const string& username) {
+    return username + ".sum";
+}
+
+string tombstone_path(const string& username) {
+    return username + ".del";
+}
+
+string message_delimiter(uint64_t uid) {
+    char line[64];
+    snprintf(line, sizeof(line), UID_DELIMITER_FORMAT, (unsigned long long)uid);
+    return line;
+}
+
+// Recognize a delimiter line (without its newline); legacy ones leave 'uid' alone
+bool parse_delimiter(const string &line, uint64_t &uid) {
+    if (line + "\n" == MESSAGE_DELIMITER) return true;
+    unsigned long long parsed = 0;
+    int end = 0;
+    if (sscanf(line.c_str(), "--- END OF MESSAGE %16llx ---%n", &parsed, &end) != 1 ||
+        end != (int)line.size()) {
+        return false;
+    }
+    uid = parsed;
+    return true;
+}
+
+string blob_link_path(uint64_t blob, uint64_t link) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx.%llu", (unsigned long long)blob, (unsigned long long)link);
+    return BLOB_DIR + name;
+}
+
+// Bytes of <user>.txt read at a time when scanning it
+const size_t SCAN_CHUNK = 1 << 20;
+
+// Scan <user>.txt from 'offset' to the end, appending a record for every
+// delimited message found. Used to build an index for a mailbox written
+// before indexes existed, or to catch up after a crash between the two writes.
+// Delimiters and blob references start with '-', so runs of CRLF lines that
+// do not are counted as a block; only the rest are looked at line by line.
+void scan_mailbox(const string& username, uint64_t offset, vector<IndexRecord>& records) {
+    int fd = open(mailbox_path(username).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    string buffer;        // Bytes read but not scanned yet, from file position 'pos'
+    uint64_t pos = offset;
+    bool eof = false;
+    IndexRecord current = {offset, 0, 0, 0, 0, 0, 0};
+    unsigned long long blob = 0, link = 0, octets = 0;
+    bool reference = false;  // The current message is so far a single reference line
+
+    while (!eof || !buffer.empty()) {
+        if (!eof) {
+            size_t kept = buffer.size();
+            buffer.resize(kept + SCAN_CHUNK);
+            ssize_t n = pread(fd, &buffer[kept], SCAN_CHUNK, pos + kept);
+            buffer.resize(kept + (n > 0 ? n : 0));
+            eof = n <= 0;
+        }
+        size_t used = 0;
+        while (used < buffer.size()) {
+            const char *data = buffer.data() + used;
+            size_t available = buffer.size() - used;
+            size_t block = plain_lines(data, available, '-');
+            if (block > 0) {
+                // Whole CRLF lines: stored and wire sizes are the same
+                current.length += block;
+                current.octets += block;
+                reference = false;
+                used += block;
+                continue;
+            }
+            const char *eol = (const char *)memchr(data, '\n', available);
+            if (!eol && !eof) break;  // The rest of the line is in the next chunk
+            string line(data, eol ? eol - data : available);
+            uint64_t line_len = eol ? line.size() + 1 : line.size();
+            // Messages from before UIDs were stored are known by their offset
+            uint64_t uid = current.offset;
+            if (parse_delimiter(line, uid)) {
+                if (current.length > 0) {
+                    current.uid = uid;
+                    current.delimiter = line_len;
+                    if (reference) {
+                        current.octets = octets;
+                        current.blob = blob;
+                        current.link = link;
+                    }
+                    records.push_back(current);
+                }
+                current = {pos + used + line_len, 0, 0, 0, 0, 0, 0};
+            } else {
+                reference = current.length == 0 &&
+                            sscanf(line.c_str(), BLOB_REFERENCE_FORMAT, &blob, &link, &octets) == 3;
+                current.length += line_len;
+                // RETR sends every line CRLF-terminated
+                current.octets += line.size() + ((!line.empty() && line.back() == '\r') ? 1 : 2);
+            }
+            used += line_len;
+        }
+        buffer.erase(0, used);
+        pos += used;
+    }
+    close(fd);
+}
+
+// Load the index of a mailbox, brought up to date with <user>.txt. Records
+// past the first 'indexed' were found by scanning the text file and are not
+// in <user>.idx yet. Only the mailbox's writer adds them, since it appends
+// to the index at a record count it keeps.
+vector<IndexRecord> load_mailbox_index(const string& username, size_t *indexed = nullptr) {
+    vector<IndexRecord> records;
+    if (indexed) *indexed = 0;
+
+    int fd = open(index_path(username).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        IndexHeader header = {};
+        struct stat st = {};
+        if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+            header.magic == INDEX_MAGIC && header.version == INDEX_VERSION &&
+            fstat(fd, &st) == 0) {
+            size_t count = (st.st_size - sizeof(header)) / sizeof(IndexRecord);
+            records.resize(count);
+            ssize_t want = count * sizeof(IndexRecord);
+            if (pread(fd, records.data(), want, sizeof(header)) != want) {
+                records.clear();
+            }
+        }
+        close(fd);
+    }
+
+    // Where the indexed part of the text file ends
+    uint64_t covered = 0;
+    if (!records.empty()) {
+        covered = records.back().offset + records.back().length + records.back().delimiter;
+    }
+
+    struct stat st = {};
+    if (stat(mailbox_path(username).c_str(), &st) != 0) {
+        return {};
+    }
+    if (covered > (uint64_t)st.st_size) {
+        // The index describes a different file: start over
+        records.clear();
+        covered = 0;
+    }
+    if (indexed) *indexed = records.size();
+    if (covered < (uint64_t)st.st_size) scan_mailbox(username, covered, records);
+    return records;
+}
+
+// Read the stored bytes of one message, CRLF-normalized for the wire.
+// Only needed for messages written before the store was wire-ready; RETR
+// sends everything else straight from the file.
+bool read_message(int fd, const MessageMeta& record, string& content) {
+    content.resize(record.length);
+    bool ok = pread(fd, &content[0], record.length, record.offset) == (ssize_t)record.length;
+
+    if (ok && record.octets != record.length) {
+        // Written by an older server with bare LF line ends
+        string normalized;
+        normalized.reserve(record.octets);
+        for (size_t i = 0; i < content.size(); ++i) {
+            if (content[i] == '\n' && (i == 0 || content[i - 1] != '\r')) normalized += '\r';
+            normalized += content[i];
+        }
+        if (normalized.empty() || normalized.back() != '\n') normalized += "\r\n";
+        content.swap(normalized);
+    }
+    return ok;
+}
+
+// How a listing describes the indexed message in 'slot'; references point at their blob link
+MessageMeta listing_entry(const IndexRecord &record, uint64_t slot) {
+    if (record.blob) {
+        return {record.octets, 0, record.octets, blob_link_path(record.blob, record.link), record.uid, slot};
+    }
+    return {record.octets, record.offset, record.length, "", record.uid, slot};
+}
+
+class FlatFileWriter : public MailboxWriter {
+public:
+    FlatFileWriter() {
+        mkdir(BLOB_DIR.c_str(), 0755);
+    }
+
+    ~FlatFileWriter() {
+        for (auto &entry : handles) {
+            close(entry.second.fd);
+            close(entry.second.idx_fd);
+        }
+    }
+
+    // Append a group of messages and make them durable with one fdatasync
+    // per file. Bytes are gathered into one write; only spooled bodies are
+    // copied over separately.
+    bool append(const string &mailbox, const vector<MessageBody *> &messages,
+                vector<MessageMeta> &added) override {
+        MailboxHandle *handle = open_handle(mailbox);
+        if (!handle) return false;
+
+        string stored;               // Gathered bytes not yet written
+        uint64_t end = handle->size; // Where 'stored' goes
+        vector<IndexRecord> records;
+        vector<string> links;
+        bool ok = true;
+        for (MessageBody *body : messages) {
+            IndexRecord record = {end + stored.size(), 0, body->size(), 0, 0, body->message_id(), 0};
+            string blob;
+            if (body->single_instance()) {
+                // Link the shared blob and store only a reference to the link
+                record.blob = body->message_id();
+                record.link = body->next_link();
+                string path = blob_link_path(record.blob, record.link);
+                if (!body->stage(blob) || link(blob.c_str(), path.c_str()) != 0) {
+                    ok = false;
+                    break;
+                }
+                links.push_back(path);
+                char reference[96];
+                snprintf(reference, sizeof(reference), BLOB_REFERENCE_FORMAT, (unsigned long long)record.blob,
+                         (unsigned long long)record.link, (unsigned long long)record.octets);
+                stored += string(reference) + "\r\n";
+            } else if (body->in_memory()) {
+                stored += body->bytes();
+            } else {
+                ok = pwrite_all(handle->fd, stored.data(), stored.size(), end) &&
+                     body->copy_to(handle->fd, end + stored.size());
+                if (!ok) break;
+                end += stored.size() + body->size();
+                stored.clear();
+            }
+            record.length = end + stored.size() - record.offset;
+            string delimiter = message_delimiter(record.uid);
+            record.delimiter = delimiter.size();
+            stored += delimiter;
+            records.push_back(record);
+        }
+
+        size_t record_bytes = records.size() * sizeof(IndexRecord);
+        off_t record_pos = sizeof(IndexHeader) + handle->count * sizeof(IndexRecord);
+        if (!ok || !write_durably({{handle->fd, stored.data(), stored.size(), end},
+                                   {handle->idx_fd, (const char *)records.data(), record_bytes,
+                                    (uint64_t)record_pos}})) {
+            // Roll back to the last good state so the file never holds half a batch
+            ftruncate(handle->fd, handle->size);
+            ftruncate(handle->idx_fd, record_pos);
+            for (const string &path : links) {
+                unlink(path.c_str());
+            }
+            return false;
+        }
+        if (!links.empty()) {
+            sync_directory(BLOB_DIR);
+        }
+        vector<MessageMeta> committed;
+        for (size_t i = 0; i < records.size(); ++i) {
+            committed.push_back(listing_entry(records[i], handle->count + i));
+        }
+        append_summaries(summary_path(mailbox), messages, committed);
+
+        handle->size = end + stored.size();
+        handle->count += records.size();
+        added.insert(added.end(), committed.begin(), committed.end());
+        return true;
+    }
+
+    void forget(const string &mailbox) override {
+        auto it = handles.find(mailbox);
+        if (it == handles.end()) return;
+        close(it->second.fd);
+        close(it->second.idx_fd);
+        handles.erase(it);
+    }
+
+    // Opening a mailbox indexes whatever its index lacks; an open one is current
+    bool catch_up(const string &mailbox) override { return open_handle(mailbox) != nullptr; }
+
+private:
+    // Open mailbox files owned by this writer
+    struct MailboxHandle {
+        int fd = -1;          // <user>.txt, only ever written past 'size'
+        int idx_fd = -1;      // <user>.idx
+        uint64_t size = 0;    // Current length of <user>.txt
+        uint64_t count = 0;   // Records in <user>.idx
+        uint64_t last_used = 0;
+    };
+
+    // Upper bound on mailbox files a writer keeps open
+    static const size_t MAX_OPEN_MAILBOXES = 256;
+
+    unordered_map<string, MailboxHandle> handles;
+    uint64_t clock = 0;
+
+    MailboxHandle *open_handle(const string &mailbox) {
+        auto it = handles.find(mailbox);
+        if (it != handles.end()) {
+            it->second.last_used = ++clock;
+            return &it->second;
+        }
+
+        if (handles.size() >= MAX_OPEN_MAILBOXES) {
+            auto oldest = handles.begin();
+            for (auto h = handles.begin(); h != handles.end(); ++h) {
+                if (h->second.last_used < oldest->second.last_used) oldest = h;
+            }
+            close(oldest->second.fd);
+            close(oldest->second.idx_fd);
+            handles.erase(oldest);
+        }
+
+        bool created = access(mailbox_path(mailbox).c_str(), F_OK) != 0;
+        MailboxHandle handle;
+        handle.fd = open(mailbox_path(mailbox).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (handle.fd < 0) return nullptr;
+
+        // Bring the index up to date before adding to it: write what a scan
+        // of <user>.txt found, and cut off anything past the last record
+        size_t indexed = 0;
+        vector<IndexRecord> records = load_mailbox_index(mailbox, &indexed);
+        handle.count = records.size();
+        handle.idx_fd = open(index_path(mailbox).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (handle.idx_fd < 0) {
+            close(handle.fd);
+            return nullptr;
+        }
+        IndexHeader header = {INDEX_MAGIC, INDEX_VERSION};
+        pwrite(handle.idx_fd, &header, sizeof(header), 0);
+        pwrite(handle.idx_fd, records.data() + indexed, (records.size() - indexed) * sizeof(IndexRecord),
+               sizeof(header) + indexed * sizeof(IndexRecord));
+        ftruncate(handle.idx_fd, sizeof(header) + handle.count * sizeof(IndexRecord));
+
+        struct stat st = {};
+        fstat(handle.fd, &st);
+        handle.size = st.st_size;
+        if (created) {
+            sync_directory(".");
+        }
+
+        handle.last_used = ++clock;
+        return &(handles[mailbox] = handle);
+    }
+};
+
+class FlatFileStore : public MailStore {
+public:
+    const char *name() const override { return "flat"; }
+    unique_ptr<MailboxWriter> new_writer() override {
+        return unique_ptr<MailboxWriter>(new FlatFileWriter);
+    }
+    vector<MessageMeta> load_listing(const string &mailbox) override {
+        vector<MessageMeta> listing;
+        size_t indexed = 0;
+        vector<IndexRecord> records = load_mailbox_index(mailbox, &indexed);
+        if (indexed < records.size()) catch_up_mailbox(mailbox);
+        Tombstones removed = load_tombstones(tombstone_path(mailbox));
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (!removed.test(i)) listing.push_back(listing_entry(records[i], i));
+        }
+        return listing;
+    }
+
+    bool remove_messages(const string &mailbox, const vector<MessageMeta> &doomed) override {
+        vector<uint64_t> slots;
+        for (const MessageMeta &meta : doomed) {
+            slots.push_back(meta.slot);
+        }
+        return add_tombstones(tombstone_path(mailbox), slots);
+    }
+
+    unique_ptr<Compaction> plan_compaction(const string &mailbox, double threshold) override {
+        vector<IndexRecord> records = load_mailbox_index(mailbox);
+        Tombstones removed = load_tombstones(tombstone_path(mailbox));
+        size_t dead = removed.count(records.size());
+        if (dead == 0 || dead < threshold * records.size()) return nullptr;
+        IndexHeader header = {INDEX_MAGIC, INDEX_VERSION};
+        RecordCompaction<IndexRecord>::Layout layout = {
+            {mailbox_path(mailbox), index_path(mailbox), tombstone_path(mailbox), summary_path(mailbox)},
+            string((const char *)&header, sizeof(header)),
+            [](const string &mailbox) { return load_mailbox_index(mailbox); },
+            [](const IndexRecord &record) { return record.length + record.delimiter; },
+            // A reference's blob link goes with it
+            [](const IndexRecord &record) {
+                if (record.blob) unlink(blob_link_path(record.blob, record.link).c_str());
+            }};
+        return unique_ptr<Compaction>(
+            new RecordCompaction<IndexRecord>(mailbox, move(layout), move(records), move(removed)));
+    }
+
+    unordered_map<uint64_t, MessageSummary> load_summaries(const string &mailbox) override {
+        return ::load_summaries(summary_path(mailbox));
+    }
+
+    bool open_message(const string &mailbox, const MessageMeta &meta, MessageSource &source) override {
+        // A reference: the message is the whole of its blob link
+        const string &path = meta.name.empty() ? mailbox_path(mailbox) : meta.name;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        if (meta.octets == meta.length) {
+            // Stored bytes are already wire-ready: let the kernel copy them
+            source.fd = fd;
+            source.owns_fd = true;
+            source.offset = meta.offset;
+            source.length = meta.length;
+            return true;
+        }
+        string content;
+        bool ok = read_message(fd, meta, content);
+        close(fd);
+        source.data = make_shared<const string>(move(content));
+        return ok;
+    }
+};
+
+// --- Maildir Store ---
+//
+// One file per message under maildir/<user>/. Delivery writes the message to
+// tmp/, syncs it and renames it into new/, so a message appears atomically
+// and deliveries never contend on a shared file. Listing a mailbox is a scan
+// of new/ and cur/; file names start with a zero-padded microsecond
+// timestamp, so sorting them gives delivery order. A message for several
+// recipients, or one spooled during DATA, is written once under spool/ and
+// hard-linked into each recipient's new/.
+
+const string MAILDIR_ROOT = "maildir";
+
+// A message's UID is a hash of its unique file name, ignoring any ":2,"
+// flags suffix, so it survives moves from new/ to cur/
+uint64_t name_uid(const string &name) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (char c : name.substr(0, name.find(':'))) {
+        hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class MaildirWriter : public MailboxWriter {
+public:
+    bool append(const string &mailbox, const vector<MessageBody *> &messages,
+                vector<MessageMeta> &added) override {
+        string base = MAILDIR_ROOT + "/" + mailbox + "/";
+        if (!ensure_maildir(base)) return false;
+
+        // Write and sync every message under tmp/ first (shared and spooled
+        // bodies are only linked there)...
+        vector<string> names;
+        bool ok = true;
+        for (MessageBody *body : messages) {
+            string name = unique_name();
+            string blob;
+            if (body->single_instance() || !body->in_memory()) {
+                if (!body->stage(blob) ||
+                    link(blob.c_str(), (base + "tmp/" + name).c_str()) != 0) {
+                    ok = false;
+                    break;
+                }
+                names.push_back(name);
+                continue;
+            }
+            int fd = open((base + "tmp/" + name).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                ok = false;
+                break;
+            }
+            names.push_back(name);
+            ok = write_all(fd, body->bytes().data(), body->bytes().size()) && fdatasync(fd) == 0;
+            close(fd);
+            if (!ok) break;
+        }
+        if (!ok) {
+            for (const string &name : names) {
+                unlink((base + "tmp/" + name).c_str());
+            }
+            return false;
+        }
+
+        // ...then publish them all and sync the directory once
+        vector<MessageMeta> committed;
+        for (size_t i = 0; i < names.size(); ++i) {
+            rename((base + "tmp/" + names[i]).c_str(), (base + "new/" + names[i]).c_str());
+            uint64_t size = messages[i]->size();
+            committed.push_back({size, 0, size, base + "new/" + names[i], name_uid(names[i])});
+        }
+        sync_directory(base + "new");
+        append_summaries(base + "summary", messages, committed);
+        added.insert(added.end(), committed.begin(), committed.end());
+        return true;
+    }
+
+private:
+    unordered_map<string, bool> known;  // Mailboxes whose directories exist
+
+    bool ensure_maildir(const string &base) {
+        if (known.count(base)) return true;
+        mkdir(MAILDIR_ROOT.c_str(), 0755);
+        mkdir(base.c_str(), 0755);
+        for (const char *sub : {"tmp", "new", "cur"}) {
+            if (mkdir((base + sub).c_str(), 0755) != 0 && errno != EEXIST) return false;
+        }
+        sync_directory(MAILDIR_ROOT);
+        sync_directory(base);
+        known[base] = true;
+        return true;
+    }
+
+    // Unique across writers and restarts: time, process and a sequence number
+    static string unique_name() {
+        static atomic<uint64_t> sequence(0);
+        uint64_t now = chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        char name[80];
+        snprintf(name, sizeof(name), "%016llu.%d_%llu.localhost", (unsigned long long)now,
+                 (int)getpid(), (unsigned long long)sequence++);
+        return name;
+    }
+};
+
+class MaildirStore : public MailStore {
+public:
+    const char *name() const override { return "maildir"; }
+    unique_ptr<MailboxWriter> new_writer() override {
+        return unique_ptr<MailboxWriter>(new MaildirWriter);
+    }
+    vector<MessageMeta> load_listing(const string &mailbox) override {
+        vector<MessageMeta> listing;
+        string base = MAILDIR_ROOT + "/" + mailbox + "/";
+        for (const char *sub : {"cur/", "new/"}) {
+            string dir = base + sub;
+            DIR *d = opendir(dir.c_str());
+            if (!d) continue;
+            while (struct dirent *entry = readdir(d)) {
+                if (entry->d_name[0] == '.') continue;
+                struct stat st = {};
+                string path = dir + entry->d_name;
+                if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                    listing.push_back({(uint64_t)st.st_size, 0, (uint64_t)st.st_size, path, name_uid(entry->d_name)});
+                }
+            }
+            closedir(d);
+        }
+        // Names lead with the delivery time, so order by the part after cur/ or new/
+        size_t prefix = base.size() + 4;
+        sort(listing.begin(), listing.end(), [prefix](const MessageMeta &a, const MessageMeta &b) {
+            return a.name.compare(prefix, string::npos, b.name, prefix, string::npos) < 0;
+        });
+        return listing;
+    }
+
+    unordered_map<uint64_t, MessageSummary> load_summaries(const string &mailbox) override {
+        return ::load_summaries(MAILDIR_ROOT + "/" + mailbox + "/summary");
+    }
+
+    bool open_message(const string &, const MessageMeta &meta, MessageSource &source) override {
+        source.fd = open(meta.name.c_str(), O_RDONLY | O_CLOEXEC);
+        source.owns_fd = true;
+        source.offset = 0;
+        source.length = meta.length;
+        return source.fd >= 0;
+    }
+
+    // A message per file needs no tombstones: removing one is an unlink
+    bool remove_messages(const string &mailbox, const vector<MessageMeta> &doomed) override {
+        for (const MessageMeta &meta : doomed) {
+            // Another session may have removed it first
+            if (unlink(meta.name.c_str()) != 0 && errno != ENOENT) return false;
+        }
+        string base = MAILDIR_ROOT + "/" + mailbox + "/";
+        sync_directory(base + "new");
+        sync_directory(base + "cur");
+        return true;
+    }
+};
+
+// --- Packed Store ---
+//
+// An at-rest format for large mailboxes. <user>.seg holds one block per
+// message: a fixed header (UID, wire size, stored size, CRC-32 of the stored
+// bytes) followed by the message, deflated when that saves space. Blocks are
+// length-prefixed, so the file can be walked header to header without
+// reading message bytes, and <user>.sidx indexes them for random access.
+// STAT/LIST/UIDL come from the index with the uncompressed octet counts;
+// only RETR and TOP read and inflate a block. UIDs and the <user>.sum header
+// index are the flat store's, so --pack converts a flat mailbox in place.
+// Shared bodies are not linked here: every mailbox compresses its own copy.
+
+const uint32_t BLOCK_MAGIC = 0x4b4c424d;  // "MBLK"
+const uint32_t SEGMENT_INDEX_MAGIC = 0x5844494b;  // "KIDX"
+
+enum BlockCodec : uint32_t { BLOCK_RAW = 0, BLOCK_DEFLATE = 1 };
+
+struct BlockHeader {
+    uint32_t magic;
+    uint32_t codec;
+    uint64_t uid;
+    uint64_t octets;   // Size on the wire, after inflating
+    uint64_t length;   // Stored bytes following this header
+    uint32_t crc;      // CRC-32 of the stored bytes
+    uint32_t reserved;
+};
+
+// Where one block is in <user>.seg
+struct SegmentRecord {
+    uint64_t offset;   // Of the block header
+    uint64_t length;   // Stored bytes after the header
+    uint64_t octets;
+    uint64_t uid;
+};
+
+string segment_path(const string& username) {
+    return username + ".seg";
+}
+
+string segment_index_path(const string& username) {
+    return username + ".sidx";
+}
+
+string segment_tombstone_path(const string& username) {
+    return username + ".sdel";
+}
+
+// Append the block for one wire-ready message to 'out'
+void encode_block(uint64_t uid, const string &message, string &out) {
+    uLongf packed_size = compressBound(message.size());
+    string packed(packed_size, '\0');
+    BlockHeader header = {BLOCK_MAGIC, BLOCK_DEFLATE, uid, message.size(), 0, 0, 0};
+    const string *stored = &packed;
+    if (compress2((Bytef *)&packed[0], &packed_size, (const Bytef *)message.data(), message.size(),
+                  Z_BEST_SPEED) == Z_OK && packed_size < message.size()) {
+        packed.resize(packed_size);
+    } else {
+        // Incompressible (or tiny): keep it as it is
+        header.codec = BLOCK_RAW;
+        stored = &message;
+    }
+    header.length = stored->size();
+    header.crc = crc32(0, (const Bytef *)stored->data(), stored->size());
+    out.append((const char *)&header, sizeof(header));
+    out += *stored;
+}
+
+// Read, check and inflate the block at 'record'
+bool decode_block(int fd, const SegmentRecord &record, string &message) {
+    BlockHeader header;
+    if (pread(fd, &header, sizeof(header), record.offset) != (ssize_t)sizeof(header) ||
+        header.magic != BLOCK_MAGIC || header.uid != record.uid || header.length != record.length) {
+        return false;
+    }
+    string stored(header.length, '\0');
+    if (pread(fd, &stored[0], header.length, record.offset + sizeof(header)) != (ssize_t)header.length ||
+        crc32(0, (const Bytef *)stored.data(), stored.size()) != header.crc) {
+        return false;
+    }
+    if (header.codec == BLOCK_RAW) {
+        message.swap(stored);
+        return message.size() == header.octets;
+    }
+    message.resize(header.octets);
+    uLongf size = header.octets;
+    return header.codec == BLOCK_DEFLATE &&
+           uncompress((Bytef *)&message[0], &size, (const Bytef *)stored.data(), stored.size()) == Z_OK &&
+           size == header.octets;
+}
+
+// Load the block index of a mailbox, catching up with <user>.seg by walking
+// the headers of any blocks the index does not cover yet. As with the flat
+// store, those past the first 'indexed' are left for the writer to record.
+vector<SegmentRecord> load_segment_index(const string& username, size_t *indexed = nullptr) {
+    vector<SegmentRecord> records;
+    if (indexed) *indexed = 0;
+    int fd = open(segment_index_path(username).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        uint32_t magic = 0;
+        struct stat st = {};
+        if (pread(fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == SEGMENT_INDEX_MAGIC &&
+            fstat(fd, &st) == 0) {
+            records.resize((st.st_size - sizeof(magic)) / sizeof(SegmentRecord));
+            ssize_t want = records.size() * sizeof(SegmentRecord);
+            if (pread(fd, records.data(), want, sizeof(magic)) != want) records.clear();
+        }
+        close(fd);
+    }
+
+    int seg = open(segment_path(username).c_str(), O_RDONLY | O_CLOEXEC);
+    if (seg < 0) return {};
+    struct stat st = {};
+    fstat(seg, &st);
+    uint64_t covered = records.empty() ? 0 : records.back().offset + sizeof(BlockHeader) + records.back().length;
+    if (covered > (uint64_t)st.st_size) {
+        records.clear();
+        covered = 0;
+    }
+    if (indexed) *indexed = records.size();
+    BlockHeader header;
+    while (covered + sizeof(header) <= (uint64_t)st.st_size &&
+           pread(seg, &header, sizeof(header), covered) == (ssize_t)sizeof(header) &&
+           header.magic == BLOCK_MAGIC && covered + sizeof(header) + header.length <= (uint64_t)st.st_size) {
+        records.push_back({covered, header.length, header.octets, header.uid});
+        covered += sizeof(header) + header.length;
+    }
+    close(seg);
+    return records;
+}
+
+class PackedWriter : public MailboxWriter {
+public:
+    ~PackedWriter() {
+        for (auto &entry : handles) {
+            close(entry.second.fd);
+            close(entry.second.idx_fd);
+        }
+    }
+
+    // Compress a group of messages into blocks and append them with one
+    // write and one fdatasync per file
+    bool append(const string &mailbox, const vector<MessageBody *> &messages,
+                vector<MessageMeta> &added) override {
+        SegmentHandle *handle = open_handle(mailbox);
+        if (!handle) return false;
+
+        string blocks;
+        vector<SegmentRecord> records;
+        string message;
+        for (MessageBody *body : messages) {
+            if (!body->read_all(message)) return false;
+            size_t start = blocks.size();
+            encode_block(body->message_id(), message, blocks);
+            records.push_back({handle->size + start, blocks.size() - start - sizeof(BlockHeader),
+                               message.size(), body->message_id()});
+        }
+
+        size_t record_bytes = records.size() * sizeof(SegmentRecord);
+        off_t record_pos = sizeof(SEGMENT_INDEX_MAGIC) + handle->count * sizeof(SegmentRecord);
+        if (!write_durably({{handle->fd, blocks.data(), blocks.size(), handle->size},
+                            {handle->idx_fd, (const char *)records.data(), record_bytes, (uint64_t)record_pos}})) {
+            // Roll back so the files never hold half a batch
+            ftruncate(handle->fd, handle->size);
+            ftruncate(handle->idx_fd, record_pos);
+            return false;
+        }
+
+        vector<MessageMeta> committed;
+        for (size_t i = 0; i < records.size(); ++i) {
+            const SegmentRecord &record = records[i];
+            committed.push_back({record.octets, record.offset, record.length, "", record.uid, handle->count + i});
+        }
+        append_summaries(summary_path(mailbox), messages, committed);
+        handle->size += blocks.size();
+        handle->count += records.size();
+        added.insert(added.end(), committed.begin(), committed.end());
+        return true;
+    }
+
+    void forget(const string &mailbox) override {
+        auto it = handles.find(mailbox);
+        if (it == handles.end()) return;
+        close(it->second.fd);
+        close(it->second.idx_fd);
+        handles.erase(it);
+    }
+
+    // Opening a mailbox indexes whatever its index lacks; an open one is current
+    bool catch_up(const string &mailbox) override { return open_handle(mailbox) != nullptr; }
+
+private:
+    struct SegmentHandle {
+        int fd = -1;          // <user>.seg, only ever written past 'size'
+        int idx_fd = -1;      // <user>.sidx
+        uint64_t size = 0;
+        uint64_t count = 0;   // Records in <user>.sidx
+        uint64_t last_used = 0;
+    };
+
+    static const size_t MAX_OPEN_MAILBOXES = 256;
+
+    unordered_map<string, SegmentHandle> handles;
+    uint64_t clock = 0;
+
+    SegmentHandle *open_handle(const string &mailbox) {
+        auto it = handles.find(mailbox);
+        if (it != handles.end()) {
+            it->second.last_used = ++clock;
+            return &it->second;
+        }
+
+        if (handles.size() >= MAX_OPEN_MAILBOXES) {
+            auto oldest = handles.begin();
+            for (auto h = handles.begin(); h != handles.end(); ++h) {
+                if (h->second.last_used < oldest->second.last_used) oldest = h;
+            }
+            close(oldest->second.fd);
+            close(oldest->second.idx_fd);
+            handles.erase(oldest);
+        }
+
+        bool created = access(segment_path(mailbox).c_str(), F_OK) != 0;
+        SegmentHandle handle;
+        handle.fd = open(segment_path(mailbox).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (handle.fd < 0) return nullptr;
+
+        // Index every complete block, then cut off a torn one left by a crash
+        size_t indexed = 0;
+        vector<SegmentRecord> records = load_segment_index(mailbox, &indexed);
+        handle.count = records.size();
+        if (!records.empty()) {
+            handle.size = records.back().offset + sizeof(BlockHeader) + records.back().length;
+        }
+        ftruncate(handle.fd, handle.size);
+        handle.idx_fd = open(segment_index_path(mailbox).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (handle.idx_fd < 0) {
+            close(handle.fd);
+            return nullptr;
+        }
+        pwrite(handle.idx_fd, &SEGMENT_INDEX_MAGIC, sizeof(SEGMENT_INDEX_MAGIC), 0);
+        pwrite(handle.idx_fd, records.data() + indexed, (records.size() - indexed) * sizeof(SegmentRecord),
+               sizeof(SEGMENT_INDEX_MAGIC) + indexed * sizeof(SegmentRecord));
+        ftruncate(handle.idx_fd, sizeof(SEGMENT_INDEX_MAGIC) + handle.count * sizeof(SegmentRecord));
+        if (created) {
+            sync_directory(".");
+        }
+
+        handle.last_used = ++clock;
+        return &(handles[mailbox] = handle);
+    }
+};
+
+class PackedStore : public MailStore {
+public:
+    const char *name() const override { return "packed"; }
+    unique_ptr<MailboxWriter> new_writer() override {
+        return unique_ptr<MailboxWriter>(new PackedWriter);
+    }
+    vector<MessageMeta> load_listing(const string &mailbox) override {
+        vector<MessageMeta> listing;
+        size_t indexed = 0;
+        vector<SegmentRecord> records = load_segment_index(mailbox, &indexed);
+        if (indexed < records.size()) catch_up_mailbox(mailbox);
+        Tombstones removed = load_tombstones(segment_tombstone_path(mailbox));
+        for (size_t i = 0; i < records.size(); ++i) {
+            const SegmentRecord &record = records[i];
+            if (!removed.test(i)) listing.push_back({record.octets, record.offset, record.length, "", record.uid, i});
+        }
+        return listing;
+    }
+
+    bool remove_messages(const string &mailbox, const vector<MessageMeta> &doomed) override {
+        vector<uint64_t> slots;
+        for (const MessageMeta &meta : doomed) {
+            slots.push_back(meta.slot);
+        }
+        return add_tombstones(segment_tombstone_path(mailbox), slots);
+    }
+
+    unique_ptr<Compaction> plan_compaction(const string &mailbox, double threshold) override {
+        vector<SegmentRecord> records = load_segment_index(mailbox);
+        Tombstones removed = load_tombstones(segment_tombstone_path(mailbox));
+        size_t dead = removed.count(records.size());
+        if (dead == 0 || dead < threshold * records.size()) return nullptr;
+        RecordCompaction<SegmentRecord>::Layout layout = {
+            {segment_path(mailbox), segment_index_path(mailbox), segment_tombstone_path(mailbox),
+             summary_path(mailbox)},
+            string((const char *)&SEGMENT_INDEX_MAGIC, sizeof(SEGMENT_INDEX_MAGIC)),
+            [](const string &mailbox) { return load_segment_index(mailbox); },
+            [](const SegmentRecord &record) { return sizeof(BlockHeader) + record.length; },
+            [](const SegmentRecord &) {}};
+        return unique_ptr<Compaction>(
+            new RecordCompaction<SegmentRecord>(mailbox, move(layout), move(records), move(removed)));
+    }
+
+    unordered_map<uint64_t, MessageSummary> load_summaries(const string &mailbox) override {
+        return ::load_summaries(summary_path(mailbox));
+    }
+
+    // The only place a block is inflated
+    bool open_message(const string &mailbox, const MessageMeta &meta, MessageSource &source) override {
+        int fd = open(segment_path(mailbox).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        string message;
+        bool ok = decode_block(fd, {meta.offset, meta.length, meta.octets, meta.uid}, message);
+        close(fd);
+        if (!ok) {
+            LOG(LogLevel::ERROR, "Corrupt block for message %016llx in %s", (unsigned long long)meta.uid,
+                segment_path(mailbox).c_str());
+            return false;
+        }
+        source.length = message.size();
+        source.data = make_shared<const string>(move(message));
+        return true;
+    }
+};
+
+// Chosen in main() with --store
+MailStore *mail_store = nullptr;
+
+// --- Search Index ---
+//
+// Each mailbox has an inverted index under search/<mailbox>/: immutable
+// segment files mapping terms to the UIDs of the messages containing them.
+// A segment starts with a sorted term directory, so a lookup is a binary
+// search over the mapped file, and each posting list is its UIDs in order,
+// delta- and varint-encoded. Deliveries are indexed by a background thread
+// after they are durable, a batch per segment, so indexing never adds to the
+// latency of the 250 reply (it has its own histogram). Segments are merged
+// like a binary counter (two of similar size become one), so a mailbox of n
+// messages has O(log n) of them. The index is derived data and is not synced;
+// --index rebuilds it from the store.
+
+const string SEARCH_DIR = "search";
+const uint32_t SEARCH_MAGIC = 0x5354464d;  // "MFTS"
+
+// Terms are runs of ASCII letters and digits, lowercased
+const size_t MIN_TERM = 2;
+const size_t MAX_TERM = 32;
+// Only the start of a message is indexed: headers and the leading text
+const uint64_t MAX_INDEXED_BYTES = 1 << 20;
+
+struct SearchSegmentHeader {
+    uint32_t magic;
+    uint32_t terms;     // Followed by a uint32 offset per term into the data
+    uint64_t messages;  // Messages indexed in this segment
+};
+
+typedef unordered_map<string, vector<uint64_t>> Postings;
+
+// Call 'add' with every distinct term of 'text'
+template <typename Fn>
+void for_each_term(const char *text, size_t len, Fn add) {
+    string term;
+    for (size_t i = 0; i <= len; ++i) {
+        if (i < len && isalnum((unsigned char)text[i])) {
+            if (term.size() < MAX_TERM + 1) term += tolower((unsigned char)text[i]);
+            continue;
+        }
+        if (term.size() >= MIN_TERM && term.size() <= MAX_TERM) add(term);
+        term.clear();
+    }
+}
+
+void put_varint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Write a segment atomically (temporary name, then rename)
+bool write_search_segment(const string &path, const Postings &postings, uint64_t messages) {
+    SearchSegmentHeader header = {SEARCH_MAGIC, (uint32_t)postings.size(), messages};
+    // The directory is binary-searched, so terms go out in order
+    vector<const Postings::value_type *> sorted;
+    for (const auto &entry : postings) {
+        sorted.push_back(&entry);
+    }
+    sort(sorted.begin(), sorted.end(), [](const Postings::value_type *a, const Postings::value_type *b) {
+        return a->first < b->first;
+    });
+    vector<uint32_t> offsets;
+    string data;
+    for (const Postings::value_type *entry : sorted) {
+        offsets.push_back(data.size());
+        data += (char)entry->first.size();
+        data += entry->first;
+        put_varint(data, entry->second.size());
+        uint64_t previous = 0;
+        for (uint64_t uid : entry->second) {
+            put_varint(data, uid - previous);
+            previous = uid;
+        }
+    }
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, (const char *)&header, sizeof(header)) &&
+              write_all(fd, (const char *)offsets.data(), offsets.size() * sizeof(uint32_t)) &&
+              write_all(fd, data.data(), data.size());
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A mapped segment file
+class SearchSegment {
+public:
+    explicit SearchSegment(const string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st = {};
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SearchSegmentHeader)) {
+            void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED) {
+                base = (const uint8_t *)mapped;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+        if (!base) return;
+        memcpy(&header, base, sizeof(header));
+        data = sizeof(header) + (uint64_t)header.terms * sizeof(uint32_t);
+        if (header.magic != SEARCH_MAGIC || data > size) {
+            munmap((void *)base, size);
+            base = nullptr;
+        }
+    }
+
+    ~SearchSegment() {
+        if (base) munmap((void *)base, size);
+    }
+
+    bool valid() const { return base != nullptr; }
+    uint64_t messages() const { return header.messages; }
+
+    // Append the UIDs of messages containing 'term'
+    void lookup(const string &term, vector<uint64_t> &uids) const {
+        uint32_t low = 0, high = header.terms;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            const uint8_t *entry = term_at(mid);
+            if (!entry) return;
+            int cmp = string((const char *)entry + 1, entry[0]).compare(term);
+            if (cmp == 0) {
+                decode(entry, uids);
+                return;
+            }
+            if (cmp < 0) low = mid + 1; else high = mid;
+        }
+    }
+
+    // Add every posting of this segment to 'postings'
+    void merge_into(Postings &postings) const {
+        for (uint32_t i = 0; i < header.terms; ++i) {
+            const uint8_t *entry = term_at(i);
+            if (!entry) return;
+            decode(entry, postings[string((const char *)entry + 1, entry[0])]);
+        }
+    }
+
+private:
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    SearchSegmentHeader header = {};
+    uint64_t data = 0;  // Where the term entries start
+
+    const uint8_t *term_at(uint32_t i) const {
+        uint32_t offset;
+        memcpy(&offset, base + sizeof(header) + (uint64_t)i * sizeof(uint32_t), sizeof(offset));
+        if (data + offset >= size || data + offset + 1 + base[data + offset] > size) return nullptr;
+        return base + data + offset;
+    }
+
+    void decode(const uint8_t *entry, vector<uint64_t> &uids) const {
+        const uint8_t *p = entry + 1 + entry[0], *end = base + size;
+        uint64_t n = 0, uid = 0, delta = 0;
+        if (!get_varint(p, end, n)) return;
+        for (uint64_t i = 0; i < n && get_varint(p, end, delta); ++i) {
+            uid += delta;
+            uids.push_back(uid);
+        }
+    }
+};
+
+string search_dir(const string &mailbox) {
+    return SEARCH_DIR + "/" + mailbox;
+}
+
+// Segment file names of a mailbox, oldest first
+vector<string> search_segments(const string &mailbox) {
+    vector<string> names;
+    DIR *dir = opendir(search_dir(mailbox).c_str());
+    if (!dir) return names;
+    while (struct dirent *entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name.size() == 20 && name.compare(16, 4, ".fts") == 0) names.push_back(name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+string segment_name(uint64_t sequence) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.fts", (unsigned long long)sequence);
+    return name;
+}
+
+// Add a batch of messages (UID and text) to a mailbox's index as a new
+// segment, then merge it with its predecessors while they are no more than
+// twice its size. Only the indexer thread (or an offline --index) writes.
+bool index_messages(const string &mailbox, const vector<pair<uint64_t, string>> &messages) {
+    Postings postings;
+    for (const auto &message : messages) {
+        const string &text = message.second;
+        for_each_term(text.data(), text.size(), [&postings, &message](const string &term) {
+            vector<uint64_t> &uids = postings[term];
+            // Terms repeat within a message; its UID is the last one added
+            if (uids.empty() || uids.back() != message.first) uids.push_back(message.first);
+        });
+    }
+    for (auto &entry : postings) {
+        sort(entry.second.begin(), entry.second.end());
+    }
+
+    mkdir(SEARCH_DIR.c_str(), 0755);
+    string dir = search_dir(mailbox);
+    mkdir(dir.c_str(), 0755);
+    vector<string> names = search_segments(mailbox);
+    uint64_t sequence = names.empty() ? 0 : strtoull(names.back().c_str(), nullptr, 16) + 1;
+    uint64_t count = messages.size();
+
+    // Fold in predecessors of similar size before writing anything
+    vector<string> merged;
+    while (!names.empty()) {
+        SearchSegment previous(dir + "/" + names.back());
+        if (previous.valid() && previous.messages() > 2 * count) break;
+        if (previous.valid()) {
+            previous.merge_into(postings);
+            count += previous.messages();
+        }
+        merged.push_back(names.back());
+        names.pop_back();
+    }
+    if (!merged.empty()) {
+        for (auto &entry : postings) {
+            vector<uint64_t> &uids = entry.second;
+            sort(uids.begin(), uids.end());
+            uids.erase(unique(uids.begin(), uids.end()), uids.end());
+        }
+    }
+    if (!write_search_segment(dir + "/" + segment_name(sequence), postings, count)) return false;
+    for (const string &name : merged) {
+        unlink((dir + "/" + name).c_str());
+    }
+    return true;
+}
+
+// UIDs of the messages in a mailbox containing every term of 'query'
+vector<uint64_t> search_mailbox(const string &mailbox, const string &query) {
+    vector<string> terms;
+    for_each_term(query.data(), query.size(), [&terms](const string &term) {
+        if (find(terms.begin(), terms.end(), term) == terms.end()) terms.push_back(term);
+    });
+    vector<uint64_t> result;
+    if (terms.empty()) return result;
+
+    // A merge may replace segments while we look; if one vanished, look again
+    vector<unique_ptr<SearchSegment>> segments;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        segments.clear();
+        bool complete = true;
+        for (const string &name : search_segments(mailbox)) {
+            segments.emplace_back(new SearchSegment(search_dir(mailbox) + "/" + name));
+            complete = complete && segments.back()->valid();
+        }
+        if (complete) break;
+    }
+
+    for (size_t t = 0; t < terms.size(); ++t) {
+        vector<uint64_t> uids;
+        for (const auto &segment : segments) {
+            if (segment->valid()) segment->lookup(terms[t], uids);
+        }
+        sort(uids.begin(), uids.end());
+        uids.erase(unique(uids.begin(), uids.end()), uids.end());
+        if (t == 0) {
+            result.swap(uids);
+        } else {
+            vector<uint64_t> both;
+            set_intersection(result.begin(), result.end(), uids.begin(), uids.end(), back_inserter(both));
+            result.swap(both);
+        }
+        if (result.empty()) break;
+    }
+    return result;
+}
+
+// Indexes committed deliveries on its own thread, a batch per mailbox
+class SearchIndexer {
+public:
+    SearchIndexer() {
+        thread(&SearchIndexer::run, this).detach();
+    }
+
+    // Called by a delivery writer once the messages are durable
+    void submit(const string &mailbox, const vector<MessageMeta> &added,
+                const vector<shared_ptr<MessageBody>> &bodies) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < added.size(); ++i) {
+            queue.push_back({mailbox, added[i].uid, bodies[i]});
+        }
+        ready.notify_one();
+    }
+
+private:
+    struct Job {
+        string mailbox;
+        uint64_t uid;
+        shared_ptr<MessageBody> body;  // Keeps a spooled body readable until indexed
+    };
+
+    mutex lock;
+    condition_variable ready;
+    vector<Job> queue;
+
+    void run() {
+        while (true) {
+            vector<Job> batch;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [this]() { return !queue.empty(); });
+                batch.swap(queue);
+            }
+            map<string, vector<pair<uint64_t, string>>> by_mailbox;
+            for (Job &job : batch) {
+                string text;
+                if (job.body->read_all(text, MAX_INDEXED_BYTES)) {
+                    by_mailbox[job.mailbox].push_back({job.uid, move(text)});
+                }
+                job.body.reset();
+            }
+            for (auto &entry : by_mailbox) {
+                uint64_t started = now_us();
+                if (index_messages(entry.first, entry.second)) {
+                    count(MESSAGES_INDEXED, entry.second.size());
+                } else {
+                    LOG(LogLevel::WARN, "Could not index %zu messages for %s", entry.second.size(),
+                        entry.first.c_str());
+                }
+                observe(INDEX_BUILD, now_us() - started);
+            }
+        }
+    }
+};
+
+// Created in main() unless --search-index 0
+SearchIndexer *search_indexer = nullptr;
+
+// --- Mailbox Cache ---
+//
+// Listings and small message bodies are shared by every POP3 session through
+// one process-wide, size-bounded LRU cache keyed by mailbox, so a user
+// polling from several devices costs one load, not one per session. Listings
+// are immutable and stored in fixed-size segments: a delivery extends a cached
+// listing by copying only its last segment, and sessions simply keep the
+// snapshot they logged in with.
+
+class MailboxListing {
+public:
+    static const size_t SEGMENT_SIZE = 512;
+
+    // A fresh listing; 'lineage' tells listings of the same on-disk history apart
+    MailboxListing(const vector<MessageMeta> &messages, uint64_t lineage) : lineage(lineage) {
+        append(messages);
+    }
+
+    size_t size() const { return count; }
+    size_t memory() const { return bytes; }
+    uint64_t lineage_id() const { return lineage; }
+
+    const MessageMeta &operator[](size_t i) const {
+        return (*segments[i / SEGMENT_SIZE])[i % SEGMENT_SIZE];
+    }
+
+    // A new listing with 'more' appended, sharing every full segment with this one
+    shared_ptr<const MailboxListing> extend(const vector<MessageMeta> &more) const {
+        shared_ptr<MailboxListing> next(new MailboxListing(*this));
+        next->append(more);
+        return next;
+    }
+
+private:
+    vector<shared_ptr<const vector<MessageMeta>>> segments;
+    size_t count = 0;
+    size_t bytes = 0;
+    uint64_t lineage;
+
+    void append(const vector<MessageMeta> &messages) {
+        size_t i = 0;
+        while (i < messages.size()) {
+            shared_ptr<vector<MessageMeta>> segment;
+            if (count % SEGMENT_SIZE == 0) {
+                segment = make_shared<vector<MessageMeta>>();
+                segment->reserve(SEGMENT_SIZE);
+                segments.push_back(segment);
+            } else {
+                // Copy the partly filled last segment; older listings may share it
+                segment = make_shared<vector<MessageMeta>>(*segments.back());
+                segments.back() = segment;
+            }
+            for (; i < messages.size() && segment->size() < SEGMENT_SIZE; ++i) {
+                segment->push_back(messages[i]);
+                bytes += sizeof(MessageMeta) + messages[i].name.capacity();
+                ++count;
+            }
+        }
+    }
+};
+
+struct CacheStats {
+    uint64_t listing_hits = 0;
+    uint64_t listing_misses = 0;
+    uint64_t body_hits = 0;
+    uint64_t body_misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0;
+};
+
+class MailboxCache {
+public:
+    // 'capacity' bounds listings plus bodies; bodies larger than 'max_body'
+    // are never cached and always go out through sendfile()
+    MailboxCache(size_t capacity, size_t max_body)
+        : shard_capacity(capacity / NUM_SHARDS), max_body(max_body) {}
+
+    // The current listing of a mailbox, from the cache or loaded from the store
+    shared_ptr<const MailboxListing> listing(MailStore &store, const string &mailbox) {
+        Shard &shard = shard_for(mailbox);
+        {
+            lock_guard<mutex> guard(shard.lock);
+            auto it = shard.entries.find(mailbox);
+            if (it != shard.entries.end() && it->second.listing) {
+                ++shard.stats.listing_hits;
+                touch(shard, it->second);
+                return it->second.listing;
+            }
+            ++shard.stats.listing_misses;
+            if (it == shard.entries.end()) {
+                // Placeholder, so a delivery racing with the load can mark it stale
+                Entry &entry = shard.entries[mailbox];
+                shard.lru.push_front(mailbox);
+                entry.lru_pos = shard.lru.begin();
+            }
+        }
+
+        uint64_t started = now_us();
+        auto loaded = make_shared<const MailboxListing>(store.load_listing(mailbox), ++next_lineage);
+        observe(MAILBOX_LOAD, now_us() - started);
+
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.entries.find(mailbox);
+        if (it != shard.entries.end() && !it->second.listing) {
+            if (it->second.stale) {
+                // Something was delivered while we read: our copy may be missing it
+                remove(shard, it);
+            } else {
+                it->second.listing = loaded;
+                shard.bytes += loaded->memory();
+                evict(shard);
+            }
+        }
+        return loaded;
+    }
+
+    // Open message i of a session's listing, serving small bodies from memory
+    bool open_message(MailStore &store, const string &mailbox, const MailboxListing &listing,
+                      size_t i, MessageSource &source) {
+        const MessageMeta &meta = listing[i];
+        if (meta.octets > max_body) {
+            return store.open_message(mailbox, meta, source);
+        }
+
+        Shard &shard = shard_for(mailbox);
+        {
+            lock_guard<mutex> guard(shard.lock);
+            Entry *entry = find_entry(shard, mailbox, listing);
+            if (entry) {
+                auto body = entry->bodies.find(i);
+                if (body != entry->bodies.end()) {
+                    ++shard.stats.body_hits;
+                    touch(shard, *entry);
+                    source.data = body->second;
+                    return true;
+                }
+            }
+            ++shard.stats.body_misses;
+        }
+
+        if (!store.open_message(mailbox, meta, source)) return false;
+        if (source.fd >= 0) {
+            string content(source.length, '\0');
+            bool ok = pread(source.fd, &content[0], source.length, source.offset) == (ssize_t)source.length;
+            if (source.owns_fd) close(source.fd);
+            source.fd = -1;
+            if (!ok) return false;
+            source.data = make_shared<const string>(move(content));
+        }
+
+        lock_guard<mutex> guard(shard.lock);
+        Entry *entry = find_entry(shard, mailbox, listing);
+        if (entry && entry->bodies.emplace(i, source.data).second) {
+            shard.bytes += source.data->size();
+            evict(shard);
+        }
+        return true;
+    }
+
+    // Called by the delivery writer once new messages are durable
+    void extend(const string &mailbox, const vector<MessageMeta> &added) {
+        Shard &shard = shard_for(mailbox);
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.entries.find(mailbox);
+        if (it == shard.entries.end()) return;
+        Entry &entry = it->second;
+        if (!entry.listing) {
+            entry.stale = true;
+            return;
+        }
+        shard.bytes -= entry.listing->memory();
+        entry.listing = entry.listing->extend(added);
+        shard.bytes += entry.listing->memory();
+        evict(shard);
+    }
+
+    // Drop a mailbox whose stored layout changed
+    void invalidate(const string &mailbox) {
+        Shard &shard = shard_for(mailbox);
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.entries.find(mailbox);
+        if (it == shard.entries.end()) return;
+        if (!it->second.listing) {
+            it->second.stale = true;
+        } else {
+            remove(shard, it);
+        }
+    }
+
+    CacheStats stats() {
+        CacheStats total;
+        for (Shard &shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            total.listing_hits += shard.stats.listing_hits;
+            total.listing_misses += shard.stats.listing_misses;
+            total.body_hits += shard.stats.body_hits;
+            total.body_misses += shard.stats.body_misses;
+            total.evictions += shard.stats.evictions;
+            total.bytes += shard.bytes;
+        }
+        return total;
+    }
+
+private:
+    static const size_t NUM_SHARDS = 16;
+
+    struct Entry {
+        shared_ptr<const MailboxListing> listing;  // Null while being loaded
+        bool stale = false;                       // Changed during the load
+        unordered_map<size_t, shared_ptr<const string>> bodies;
+        list<string>::iterator lru_pos;
+    };
+
+    struct Shard {
+        mutex lock;
+        unordered_map<string, Entry> entries;
+        list<string> lru;  // Most recently used first
+        size_t bytes = 0;
+        CacheStats stats;
+    };
+
+    Shard shards[NUM_SHARDS];
+    size_t shard_capacity;
+    size_t max_body;
+    atomic<uint64_t> next_lineage{0};
+
+    Shard &shard_for(const string &mailbox) {
+        return shards[hash<string>()(mailbox) % NUM_SHARDS];
+    }
+
+    // The cached entry, provided it describes the same history as 'listing'
+    Entry *find_entry(Shard &shard, const string &mailbox, const MailboxListing &listing) {
+        auto it = shard.entries.find(mailbox);
+        if (it == shard.entries.end() || !it->second.listing ||
+            it->second.listing->lineage_id() != listing.lineage_id()) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    void touch(Shard &shard, Entry &entry) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru_pos);
+    }
+
+    void remove(Shard &shard, unordered_map<string, Entry>::iterator it) {
+        Entry &entry = it->second;
+        if (entry.listing) shard.bytes -= entry.listing->memory();
+        for (auto &body : entry.bodies) {
+            shard.bytes -= body.second->size();
+        }
+        shard.lru.erase(entry.lru_pos);
+        shard.entries.erase(it);
+    }
+
+    void evict(Shard &shard) {
+        while (shard.bytes > shard_capacity && !shard.lru.empty()) {
+            remove(shard, shard.entries.find(shard.lru.back()));
+            ++shard.stats.evictions;
+        }
+    }
+};
+
+// Created in main()
+MailboxCache *mailbox_cache = nullptr;
+
+// --- Delivery ---
+//
+// All mailbox appends go through the DeliveryWriter. Each mailbox hashes to
+// one writer shard, and a shard is a single thread with its own MailboxWriter,
+// so appends to one mailbox are serialized without any locking. A shard
+// drains everything queued for it as one batch and hands each mailbox's share
+// to the store in a single append, which writes and syncs it as a group
+// (group commit). Sessions are told the outcome only after that, so a 250
+// always means the message is on disk. A message with several recipients is
+// one job per recipient, all sharing a single MessageBody. Other changes to
+// a mailbox (POP3 deletions, the end of a compaction) run as tasks on the
+// same shard, so they are serialized with its appends the same way.
+
+struct DeliveryJob {
+    string mailbox;
+    shared_ptr<MessageBody> body; // Message bytes as received in DATA
+    function<void(bool)> done;    // Called from the writer thread with the outcome
+    function<bool(MailboxWriter &)> task;  // Instead of a body: work to run between appends
+};
+
+class DeliveryWriter {
+public:
+    // 'window' is how long a shard keeps collecting after the first job of a
+    // batch arrives: longer windows mean bigger batches and fewer syncs, at
+    // the cost of that much added latency per delivery. Zero still batches
+    // whatever queued up while the previous commit was syncing.
+    DeliveryWriter(MailStore &store, unsigned num_shards, chrono::microseconds window) : window(window) {
+        for (unsigned i = 0; i < num_shards; ++i) {
+            shards.emplace_back(new Shard);
+            shards.back()->writer = store.new_writer();
+        }
+        for (auto &shard : shards) {
+            thread(&DeliveryWriter::run, this, ref(*shard)).detach();
+        }
+    }
+
+    void submit(DeliveryJob job) {
+        Shard &shard = *shards[hash<string>()(job.mailbox) % shards.size()];
+        lock_guard<mutex> guard(shard.lock);
+        shard.queue.push_back(move(job));
+        shard.ready.notify_one();
+    }
+
+    // Run 'task' on the thread that appends to 'mailbox', after the appends
+    // already queued for it, and report its result to 'done' from there
+    void run_task(const string &mailbox, function<bool(MailboxWriter &)> task, function<void(bool)> done) {
+        submit({mailbox, nullptr, move(done), move(task)});
+    }
+
+private:
+    struct Shard {
+        mutex lock;
+        condition_variable ready;
+        vector<DeliveryJob> queue;
+        unique_ptr<MailboxWriter> writer;
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    chrono::microseconds window;
+
+    void run(Shard &shard) {
+        while (true) {
+            vector<DeliveryJob> batch;
+            {
+                unique_lock<mutex> guard(shard.lock);
+                shard.ready.wait(guard, [&shard]() { return !shard.queue.empty(); });
+                if (window.count() > 0) {
+                    // Let more sessions join this commit
+                    guard.unlock();
+                    this_thread::sleep_for(window);
+                    guard.lock();
+                }
+                batch.swap(shard.queue);
+            }
+
+            // Group the batch by mailbox, keeping arrival order within each
+            unordered_map<string, vector<DeliveryJob *>> by_mailbox;
+            vector<DeliveryJob *> tasks;
+            for (DeliveryJob &job : batch) {
+                if (job.task) {
+                    tasks.push_back(&job);
+                } else {
+                    by_mailbox[job.mailbox].push_back(&job);
+                }
+            }
+            for (auto &entry : by_mailbox) {
+                vector<MessageBody *> messages;
+                for (DeliveryJob *job : entry.second) {
+                    messages.push_back(job->body.get());
+                }
+                vector<MessageMeta> added;
+                bool ok = shard.writer->append(entry.first, messages, added);
+                if (ok) {
+                    mailbox_cache->extend(entry.first, added);
+                }
+                if (ok && search_indexer) {
+                    vector<shared_ptr<MessageBody>> bodies;
+                    for (DeliveryJob *job : entry.second) {
+                        bodies.push_back(job->body);
+                    }
+                    search_indexer->submit(entry.first, added, bodies);
+                }
+                count(COMMIT_BATCHES);
+                count(ok ? MESSAGES_DELIVERED : DELIVERY_FAILURES, messages.size());
+                for (DeliveryJob *job : entry.second) {
+                    job->done(ok);
+                }
+            }
+            for (DeliveryJob *job : tasks) {
+                job->done(job->task(*shard.writer));
+            }
+        }
+    }
+};
+
+// Created in main()
+DeliveryWriter *delivery_writer = nullptr;
+
+void catch_up_mailbox(const string &mailbox) {
+    // The offline tools run without writers; the next server start catches up
+    if (!delivery_writer) return;
+    delivery_writer->run_task(mailbox, [mailbox](MailboxWriter &writer) { return writer.catch_up(mailbox); },
+                              [](bool) {});
+}
+
+// --- Mailbox Leases and Compaction ---
+//
+// A POP3 session holds a lease on its mailbox from login until its deletions
+// are recorded, because the slots in its listing must keep naming the same
+// messages. A compaction renumbers them, so it only swaps its files in while
+// no lease is held, and logins wait for the swap to finish.
+
+class MailboxLeases {
+public:
+    class Lease {
+    public:
+        Lease(MailboxLeases &leases, const string &mailbox) : leases(leases), mailbox(mailbox) {}
+        ~Lease() { leases.release(mailbox); }
+
+    private:
+        MailboxLeases &leases;
+        string mailbox;
+    };
+
+    shared_ptr<Lease> acquire(const string &mailbox) {
+        lock_guard<mutex> guard(lock);
+        ++held[mailbox];
+        return make_shared<Lease>(*this, mailbox);
+    }
+
+    // Run 'fn' with no lease on 'mailbox' held or granted meanwhile; false,
+    // without running it, if one is held
+    bool exclusive(const string &mailbox, const function<void()> &fn) {
+        lock_guard<mutex> guard(lock);
+        if (held.count(mailbox)) return false;
+        fn();
+        return true;
+    }
+
+private:
+    mutex lock;
+    unordered_map<string, size_t> held;
+
+    void release(const string &mailbox) {
+        lock_guard<mutex> guard(lock);
+        if (--held[mailbox] == 0) held.erase(mailbox);
+    }
+};
+
+MailboxLeases mailbox_leases;
+
+// Rewrites mailboxes once the share of removed messages in them passes
+// --compact-threshold. One background thread; a mailbox still leased when
+// its copy is done is tried again a little later.
+class Compactor {
+public:
+    explicit Compactor(double threshold) : threshold(threshold) {
+        thread(&Compactor::run, this).detach();
+    }
+
+    // Called once a session's deletions are recorded
+    void submit(const string &mailbox) {
+        lock_guard<mutex> guard(lock);
+        pending[mailbox] = 0;
+        ready.notify_one();
+    }
+
+private:
+    static const uint64_t RETRY_US = 1000000;
+
+    double threshold;
+    mutex lock;
+    condition_variable ready;
+    map<string, uint64_t> pending;  // Mailbox, and when to try it (now_us)
+
+    void run() {
+        while (true) {
+            string mailbox;
+            {
+                unique_lock<mutex> guard(lock);
+                while (mailbox.empty()) {
+                    uint64_t now = now_us(), next = UINT64_MAX;
+                    for (auto &entry : pending) {
+                        if (entry.second <= now) {
+                            mailbox = entry.first;
+                            break;
+                        }
+                        next = min(next, entry.second);
+                    }
+                    if (!mailbox.empty()) break;
+                    if (next == UINT64_MAX) {
+                        ready.wait(guard);
+                    } else {
+                        ready.wait_for(guard, chrono::microseconds(next - now));
+                    }
+                }
+                pending.erase(mailbox);
+            }
+            compact(mailbox);
+        }
+    }
+
+    void compact(const string &mailbox) {
+        unique_ptr<Compaction> job = mail_store->plan_compaction(mailbox, threshold);
+        if (!job) return;
+        uint64_t started = now_us();
+        bool ok = job->copy();
+        bool busy = false;
+        if (ok) {
+            promise<bool> finished;
+            future<bool> result = finished.get_future();
+            delivery_writer->run_task(mailbox, [&job, &mailbox, &busy](MailboxWriter &writer) {
+                bool done = false;
+                busy = !mailbox_leases.exclusive(mailbox, [&]() {
+                    done = job->finish(writer);
+                    if (done) mailbox_cache->invalidate(mailbox);
+                });
+                return done;
+            }, [&finished](bool done) { finished.set_value(done); });
+            ok = result.get();
+        }
+        if (busy) {
+            LOG(LogLevel::DEBUG, "Compaction of %s deferred: mailbox in use", mailbox.c_str());
+            lock_guard<mutex> guard(lock);
+            pending.emplace(mailbox, now_us() + RETRY_US);
+            return;
+        }
+        if (!ok) {
+            LOG(LogLevel::ERROR, "Could not compact %s", mailbox.c_str());
+            return;
+        }
+        count(COMPACTIONS);
+        observe(COMPACTION, now_us() - started);
+        LOG(LogLevel::INFO, "Compacted %s: %zu messages, %llu bytes to %zu, %llu", mailbox.c_str(),
+            job->messages_before, (unsigned long long)job->bytes_before, job->messages_after,
+            (unsigned long long)job->bytes_after);
+    }
+};
+
+// Created in main() unless --compact-threshold 0
+Compactor *compactor = nullptr;
+
+// --- Session State ---
+
+// A piece of pending output: bytes we own, or a byte range of an open file
+// that is handed to sendfile() so message bodies never pass through userspace
+// (with io_uring, read by the ring into a chunk of the send batch instead).
+struct OutputChunk {
+    string data;
+    shared_ptr<const string> shared;  // Bytes owned elsewhere (cached bodies), sent instead of 'data'
+    int file_fd = -1;    // When >= 0, send 'length' bytes of this file from 'offset'
+    bool owns_fd = false; // Close file_fd once the range is sent
+    off_t offset = 0;    // For data chunks: how much of 'data' is already sent
+    size_t length = 0;
+};
+
+// io_uring: the chunks taken off a session's output for the send in flight,
+// plus any message file bytes read for it. The kernel points into them until
+// the send completes, so nothing here changes meanwhile.
+struct SendBatch {
+    vector<OutputChunk> chunks;
+    size_t head = 0;  // First chunk not fully sent
+    vector<struct iovec> iov;
+    struct msghdr msg = {};
+};
+
+class EventLoop;
+
+// Hand a completion back to the loop that owns the session (defined below)
+void post_delivery_result(EventLoop *loop, int fd, uint64_t id, bool ok);
+
+// Longest line we are willing to buffer while waiting for its CRLF
+const size_t MAX_LINE_LENGTH = 64 * 1024;
+
+// Most input a paused session may hold, complete lines included
+const size_t MAX_PAUSED_INPUT = 4 * MAX_LINE_LENGTH;
+
+// Input and output buffer space a connection keeps once they have drained
+const size_t KEPT_BUFFER = 1024;
+
+// One accepted client socket. The event loop owns it and feeds it whatever
+// bytes arrive; replies are queued in 'out' and written when the socket allows.
+struct Connection {
+    int fd;
+    Protocol protocol;
+    LineFramer in;       // Received bytes not yet framed into complete lines
+    vector<OutputChunk> out; // Pending output not yet accepted by the kernel
+    size_t out_head = 0;  // First chunk of 'out' still to be written
+    bool closing = false; // Close once 'out' has drained (after QUIT)
+    bool paused = false;  // Waiting on background work; input stays buffered
+    EventLoop *loop = nullptr; // Loop that owns this connection
+    uint64_t id = 0;      // Unique per loop, so stale completions can be told apart
+    bool greeted = true;  // No command has arrived since the greeting yet
+    uint64_t last_active_ms = 0; // Last time bytes moved in either direction
+    uint64_t timer_ms = 0;       // When this connection's live timer is due
+    uint64_t bytes_in = 0;
+    SendBatch sending;    // io_uring: output of the send (or file read) in flight
+    bool io_busy = false;
+    bool receiving = false;       // io_uring: its multishot receive is armed
+    bool recv_cancelled = false;  // ... and asked to stop while the session is paused
+
+    Connection(int fd, Protocol protocol) : fd(fd), protocol(protocol), in(MAX_LINE_LENGTH) {}
+    virtual ~Connection() {
+        for (size_t i = out_head; i < out.size(); ++i) {
+            if (out[i].owns_fd) close(out[i].file_fd);
+        }
+    }
+};
+
+struct Pop3Session : Connection {
+    string username;
+    bool logged_in = false;
+    shared_ptr<const MailboxListing> listing;  // Snapshot of the mailbox taken at login
+    uint64_t retr_started = 0;  // When the oldest unfinished RETR arrived
+    unordered_map<uint64_t, MessageSummary> summaries;  // Header index, read on first TOP/XSUMMARY
+    bool summaries_loaded = false;
+    unordered_map<uint64_t, size_t> uid_numbers;  // UID to message number, built on first XSEARCH
+    shared_ptr<MailboxLeases::Lease> lease;  // Taken at login
+    vector<bool> deleted;      // Marked by DELE, by message number - 1; applied at QUIT
+    size_t deleted_count = 0;
+
+    explicit Pop3Session(int fd) : Connection(fd, Protocol::POP3) {}
+};
+
+struct SmtpSession : Connection {
+    Envelope envelope;          // MAIL sender and RCPT mailboxes, without duplicates
+    string data_body;           // DATA not yet spooled; bounded by SPOOL_BUFFER
+    int spool_fd = -1;          // Spool file, once DATA outgrew data_body
+    string spool_path;
+    uint64_t data_size = 0;     // Bytes of DATA received so far
+    const char *data_error = nullptr; // Reply owed at the final dot instead of delivering
+    SummaryBuilder summary;     // Header index entry, built from DATA as it arrives
+    bool in_data_mode = false;
+    uint64_t transaction_started = 0;  // HELO, or the end of the previous transaction
+    uint64_t data_finished = 0;        // When the final dot of DATA arrived
+    uint64_t rate_check_ms = 0;        // End of the current DATA throughput window
+    uint64_t rate_mark = 0;            // bytes_in when that window started
+
+    explicit SmtpSession(int fd) : Connection(fd, Protocol::SMTP) {}
+    ~SmtpSession() { discard_spool(); }
+
+    // Drop the spool file of a message that will not be delivered
+    void discard_spool() {
+        if (spool_fd < 0) return;
+        close(spool_fd);
+        unlink(spool_path.c_str());
+        spool_fd = -1;
+        spool_path.clear();
+    }
+};
+
+// --- Helper Functions ---
+
+// The buffer at the end of the pending output. Replies are appended to it,
+// so everything a batch of commands produces goes out in as few writes as
+// possible; listings are formatted straight into it rather than built up
+// in a string of their own and copied.
+string &output_buffer(Connection &conn) {
+    if (conn.out.size() == conn.out_head || conn.out.back().file_fd >= 0 || conn.out.back().shared) {
+        conn.out.emplace_back();
+    }
+    return conn.out.back().data;
+}
+
+// Queue raw bytes for the client
+void queue_output(Connection &conn, string_view bytes) {
+    output_buffer(conn) += bytes;
+}
+
+// Append a number in decimal without a temporary string
+void append_number(string &out, uint64_t value) {
+    char digits[24];
+    out.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+}
+
+// Queue the bytes of a stored message for the client. File ranges are sent
+// with sendfile(); a file the source does not own must stay open until sent.
+void queue_message(Connection &conn, MessageSource &source) {
+    OutputChunk chunk;
+    if (source.fd < 0) {
+        // Reference the bytes rather than copy them into the output buffer
+        chunk.shared = source.data;
+        conn.out.push_back(move(chunk));
+        return;
+    }
+    chunk.file_fd = source.fd;
+    chunk.owns_fd = source.owns_fd;
+    chunk.offset = source.offset;
+    chunk.length = source.length;
+    conn.out.push_back(move(chunk));
+}
+
+// Queue a response string for the client
+void send_response(Connection &conn, string_view msg) {
+    queue_output(conn, msg);
+    queue_output(conn, "\r\n");
+    LOG(LogLevel::TRACE, "Server Sent: %.*s", (int)msg.size(), msg.data());
+}
+
+// --- POP3 Mail Retrieval Logic ---
+
+// UIDs go on the wire as 16 hex digits
+void append_uid(string &out, uint64_t uid) {
+    static const char HEX[] = "0123456789abcdef";
+    for (int shift = 60; shift >= 0; shift -= 4) out += HEX[(uid >> shift) & 15];
+}
+
+string format_uid(uint64_t uid) {
+    string text;
+    append_uid(text, uid);
+    return text;
+}
+
+// Size of the message a source reads from
+uint64_t source_length(const MessageSource &source) {
+    return source.fd < 0 ? source.data->size() : source.length;
+}
+
+// Read up to 'len' bytes of a message starting 'pos' bytes into it
+string read_source(const MessageSource &source, uint64_t pos, size_t len) {
+    if (pos >= source_length(source)) return "";
+    len = min<uint64_t>(len, source_length(source) - pos);
+    if (source.fd < 0) return source.data->substr(pos, len);
+    string bytes(len, '\0');
+    ssize_t n = pread(source.fd, &bytes[0], len, source.offset + pos);
+    bytes.resize(n > 0 ? n : 0);
+    return bytes;
+}
+
+// Summarize a message the header index does not cover by reading its
+// stored header block, never the body
+MessageSummary summarize_message(const MessageSource &source) {
+    SummaryBuilder builder;
+    string line;
+    uint64_t pos = 0;
+    while (builder.in_headers && pos < source_length(source)) {
+        string chunk = read_source(source, pos, 4096);
+        if (chunk.empty()) break;
+        pos += chunk.size();
+        for (size_t i = 0; i < chunk.size() && builder.in_headers; ++i) {
+            if (chunk[i] != '\n') {
+                line += chunk[i];
+                continue;
+            }
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            builder.add_line(line);
+            line.clear();
+        }
+    }
+    if (builder.in_headers && !line.empty()) builder.add_line(line);
+    return move(builder.summary);
+}
+
+// The summary of message i of the session's listing: from the header index,
+// which is read once per session, or else from the message itself
+bool message_summary(Pop3Session &session, size_t i, MessageSummary &summary) {
+    if (!session.summaries_loaded) {
+        session.summaries = mail_store->load_summaries(session.username);
+        session.summaries_loaded = true;
+    }
+    const MessageMeta &meta = (*session.listing)[i];
+    auto it = session.summaries.find(meta.uid);
+    if (it != session.summaries.end()) {
+        summary = it->second;
+        return true;
+    }
+    MessageSource source;
+    if (!mail_store->open_message(session.username, meta, source)) return false;
+    summary = summarize_message(source);
+    if (source.owns_fd) close(source.fd);
+    session.summaries[meta.uid] = summary;
+    return true;
+}
+
+// The header block of a message and the first 'lines' lines of its body,
+// as TOP sends them: only that much is read from the store
+string read_top(const MessageSource &source, uint64_t header_length, uint64_t lines) {
+    string top = read_source(source, 0, header_length);
+    uint64_t pos = top.size();
+    while (lines > 0 && pos < source_length(source)) {
+        string chunk = read_source(source, pos, 4096);
+        if (chunk.empty()) break;
+        size_t end = 0;
+        while (lines > 0 && end < chunk.size()) {
+            size_t newline = chunk.find('\n', end);
+            if (newline == string::npos) {
+                end = chunk.size();
+                break;
+            }
+            end = newline + 1;
+            --lines;
+        }
+        top.append(chunk, 0, end);
+        pos += end;
+    }
+    if (needs_final_crlf(top) && !top.empty()) top += "\r\n";
+    return top;
+}
+
+// Check a message number argument, replying with the error if it does not
+// name a message of the session's listing that is still there
+bool check_message(Pop3Session &session, long long msg_num) {
+    if (msg_num <= 0 || msg_num > (long long)session.listing->size()) {
+        send_response(session, "-ERR No such message");
+        return false;
+    }
+    if (session.deleted[msg_num - 1]) {
+        send_response(session, "-ERR Message deleted");
+        return false;
+    }
+    return true;
+}
+
+// Reply to QUIT once the session's deletions are recorded, or failed to be
+void finish_update(Pop3Session &session, bool ok) {
+    if (ok) {
+        count(MESSAGES_DELETED, session.deleted_count);
+        send_response(session, "+OK Bye");
+    } else {
+        send_response(session, "-ERR Some deleted messages not removed");
+    }
+    session.closing = true;
+    session.paused = false;
+}
+
+// Handle one command from a POP3 client
+void handle_pop3_client(Pop3Session &session, string_view line) {
+    LOG(LogLevel::TRACE, "POP3 Client Recv: %.*s", (int)line.size(), line.data());
+    Command command = parse_command(line);
+    string_view argument = command.argument;
+    count_command(Protocol::POP3, command.verb);
+
+    if (command.verb == Verb::QUIT) {
+        if (session.deleted_count == 0) {
+            send_response(session, "+OK Bye");
+            session.closing = true;
+            return;
+        }
+        // The UPDATE state: make the deletions permanent on the mailbox's
+        // writer thread, and reply once they are. The task holds the lease
+        // even if the client goes away meanwhile.
+        vector<MessageMeta> doomed;
+        for (size_t i = 0; i < session.deleted.size(); ++i) {
+            if (session.deleted[i]) doomed.push_back((*session.listing)[i]);
+        }
+        session.paused = true;
+        EventLoop *loop = session.loop;
+        int fd = session.fd;
+        uint64_t id = session.id;
+        string mailbox = session.username;
+        shared_ptr<MailboxLeases::Lease> lease = session.lease;
+        delivery_writer->run_task(mailbox, [mailbox, doomed, lease](MailboxWriter &) {
+            bool ok = mail_store->remove_messages(mailbox, doomed);
+            if (ok) mailbox_cache->invalidate(mailbox);
+            if (ok && compactor) compactor->submit(mailbox);
+            return ok;
+        }, [loop, fd, id](bool ok) { post_delivery_result(loop, fd, id, ok); });
+        return;
+    }
+
+    if (!session.logged_in) {
+        if (command.verb == Verb::USER) {
+            // For simplicity, we assume the USER command contains the full email address
+            if (valid_mailbox_name(argument)) {
+                session.username = argument;
+                send_response(session, "+OK User name accepted, password please");
+            } else {
+                session.username.clear();
+                send_response(session, "-ERR Mailbox name not allowed");
+            }
+        } else if (command.verb == Verb::PASS) {
+            if (!session.username.empty()) {
+                // Open the mailbox based on the username provided
+                session.lease = mailbox_leases.acquire(session.username);
+                session.listing = mailbox_cache->listing(*mail_store, session.username);
+                session.deleted.assign(session.listing->size(), false);
+                session.logged_in = true;
+                // Just send a simple +OK, don't include STAT info here
+                send_response(session, "+OK Logged in");
+            } else {
+                send_response(session, "-ERR USER command required first");
+            }
+        } else {
+            send_response(session, "-ERR Authentication required");
+        }
+        return;
+    }
+
+    // Commands requiring authentication
+    const MailboxListing &mailbox = *session.listing;
+    long long msg_num = 0;
+    switch (command.verb) {
+    case Verb::STAT: {
+        // Returns number of messages and total size, leaving out deleted ones
+        uint64_t total_size = 0;
+        for (size_t i = 0; i < mailbox.size(); ++i) {
+            if (!session.deleted[i]) total_size += mailbox[i].octets;
+        }
+        string &out = output_buffer(session);
+        out += "+OK ";
+        append_number(out, mailbox.size() - session.deleted_count);
+        out += ' ';
+        append_number(out, total_size);
+        out += "\r\n";
+        break;
+    }
+    case Verb::LIST: {
+        // Lists message numbers and sizes
+        string &out = output_buffer(session);
+        out += "+OK Mailbox scan listing follows\r\n";
+        for (size_t i = 0; i < mailbox.size(); ++i) {
+            if (session.deleted[i]) continue;
+            append_number(out, i + 1);
+            out += ' ';
+            append_number(out, mailbox[i].octets);
+            out += "\r\n";
+        }
+        out += ".\r\n"; // POP3 termination dot
+        LOG(LogLevel::TRACE, "Server Sent: [LIST Response]");
+        break;
+    }
+    case Verb::UIDL:
+        // Unique ids, so clients can tell which messages they already have
+        if (argument.empty()) {
+            string &out = output_buffer(session);
+            out += "+OK Unique-id listing follows\r\n";
+            for (size_t i = 0; i < mailbox.size(); ++i) {
+                if (session.deleted[i]) continue;
+                append_number(out, i + 1);
+                out += ' ';
+                append_uid(out, mailbox[i].uid);
+                out += "\r\n";
+            }
+            out += ".\r\n";
+            return;
+        }
+        take_number(argument, msg_num);
+        if (check_message(session, msg_num)) {
+            string &out = output_buffer(session);
+            out += "+OK ";
+            append_number(out, msg_num);
+            out += ' ';
+            append_uid(out, mailbox[msg_num - 1].uid);
+            out += "\r\n";
+        }
+        break;
+    case Verb::TOP: {
+        // Headers plus the first lines of the body (RFC 1939), located through
+        // the header index instead of by parsing the message
+        long long lines = -1;
+        if (!take_number(argument, msg_num) || !take_number(argument, lines) || lines < 0) {
+            send_response(session, "-ERR Usage: TOP msg lines");
+            return;
+        }
+        if (!check_message(session, msg_num)) return;
+        MessageSummary summary;
+        MessageSource source;
+        if (!message_summary(session, msg_num - 1, summary) ||
+            !mail_store->open_message(session.username, mailbox[msg_num - 1], source)) {
+            send_response(session, "-ERR Message could not be read");
+            return;
+        }
+        string top = read_top(source, summary.header_length, lines);
+        if (source.owns_fd) close(source.fd);
+        queue_output(session, "+OK Top of message follows\r\n");
+        queue_output(session, top);
+        queue_output(session, ".\r\n");
+        LOG(LogLevel::TRACE, "Server Sent: [TOP Response]");
+        break;
+    }
+    case Verb::XSUMMARY: {
+        // One line per message: number, UID, octets, From and Subject, the
+        // last three separated by tabs. Served from the header index, so an
+        // overview of the mailbox does not read any message.
+        MessageSummary summary;
+        auto summary_line = [&mailbox, &summary](string &out, size_t i) {
+            append_number(out, i + 1);
+            out += ' ';
+            append_uid(out, mailbox[i].uid);
+            out += ' ';
+            append_number(out, mailbox[i].octets);
+            out += '\t';
+            out += summary.from;
+            out += '\t';
+            out += summary.subject;
+            out += "\r\n";
+        };
+        if (argument.empty()) {
+            string &out = output_buffer(session);
+            out += "+OK Summary listing follows\r\n";
+            for (size_t i = 0; i < mailbox.size(); ++i) {
+                if (!session.deleted[i] && message_summary(session, i, summary)) summary_line(out, i);
+            }
+            out += ".\r\n";
+            return;
+        }
+        take_number(argument, msg_num);
+        if (!check_message(session, msg_num)) {
+            return;
+        } else if (!message_summary(session, msg_num - 1, summary)) {
+            send_response(session, "-ERR Message could not be read");
+        } else {
+            string &out = output_buffer(session);
+            out += "+OK ";
+            summary_line(out, msg_num - 1);
+        }
+        break;
+    }
+    case Verb::XSEARCH: {
+        // Messages containing every word of the argument, from the search
+        // index: one "number UID" line each, in message number order
+        if (argument.empty()) {
+            send_response(session, "-ERR Usage: XSEARCH words");
+            return;
+        }
+        uint64_t started = now_us();
+        if (session.uid_numbers.empty()) {
+            for (size_t i = 0; i < mailbox.size(); ++i) {
+                session.uid_numbers[mailbox[i].uid] = i + 1;
+            }
+        }
+        vector<size_t> numbers;
+        for (uint64_t uid : search_mailbox(session.username, string(argument))) {
+            // Messages delivered after login are not in this session's listing
+            auto it = session.uid_numbers.find(uid);
+            if (it != session.uid_numbers.end() && !session.deleted[it->second - 1]) numbers.push_back(it->second);
+        }
+        sort(numbers.begin(), numbers.end());
+        string &out = output_buffer(session);
+        out += "+OK ";
+        append_number(out, numbers.size());
+        out += " messages match\r\n";
+        for (size_t number : numbers) {
+            append_number(out, number);
+            out += ' ';
+            append_uid(out, mailbox[number - 1].uid);
+            out += "\r\n";
+        }
+        out += ".\r\n";
+        observe(SEARCH_QUERY, now_us() - started);
+        break;
+    }
+    case Verb::RETR:
+        // Retrieve email by index
+        if (!take_number(argument, msg_num)) {
+            send_response(session, "-ERR Invalid message number");
+            return;
+        }
+
+        if (check_message(session, msg_num)) {
+            MessageSource source;
+            if (!mailbox_cache->open_message(*mail_store, session.username, mailbox, msg_num - 1, source)) {
+                send_response(session, "-ERR Message could not be read");
+                return;
+            }
+
+            // Header + CRLF + Content + Dot + CRLF
+            if (!session.retr_started) session.retr_started = now_us();
+            string &out = output_buffer(session);
+            out += "+OK ";
+            append_number(out, mailbox[msg_num - 1].octets);
+            out += " octets\r\n";
+            queue_message(session, source);
+
+            // Append the dot terminator: POP3 requires a line with just a dot, followed by CRLF
+            queue_output(session, ".\r\n");
+            LOG(LogLevel::TRACE, "Server Sent: [Full Email Content]");
+        }
+        break;
+    case Verb::DELE:
+        // Only marked here; the mailbox changes when the session quits
+        take_number(argument, msg_num);
+        if (check_message(session, msg_num)) {
+            session.deleted[msg_num - 1] = true;
+            ++session.deleted_count;
+            send_response(session, "+OK Message deleted");
+        }
+        break;
+    case Verb::RSET: {
+        // Unmark everything DELE marked
+        session.deleted.assign(mailbox.size(), false);
+        session.deleted_count = 0;
+        uint64_t total_size = 0;
+        for (size_t i = 0; i < mailbox.size(); ++i) {
+            total_size += mailbox[i].octets;
+        }
+        string &out = output_buffer(session);
+        out += "+OK Maildrop has ";
+        append_number(out, mailbox.size());
+        out += " messages (";
+        append_number(out, total_size);
+        out += " octets)\r\n";
+        break;
+    }
+    default:
+        send_response(session, "-ERR Unknown command");
+    }
+}
+
+// --- SMTP Mail Sending Logic ---
+
+// Recipients accepted per transaction; RFC 5321 asks for at least 100
+const size_t MAX_RECIPIENTS = 1000;
+
+// DATA is buffered in memory up to this much, then written out to a spool
+// file, so a session's memory does not grow with the size of the message
+const size_t SPOOL_BUFFER = 64 * 1024;
+
+// Largest message accepted (--max-message-size), advertised with SIZE
+uint64_t max_message_size = 64ull << 20;
+
+const char *MESSAGE_TOO_LARGE = "552 Message size exceeds fixed maximum message size";
+const char *LOCAL_ERROR = "451 Requested action aborted: local error in processing";
+const char *BAD_SEQUENCE = "503 Bad sequence of commands";
+
+// Reset the mail transaction (after delivery, RSET or a failed DATA)
+void reset_transaction(SmtpSession &session) {
+    session.envelope.clear();
+    session.data_body.clear();
+    session.discard_spool();
+    session.data_size = 0;
+    session.data_error = nullptr;
+    session.summary = SummaryBuilder();
+}
+
+// Move buffered DATA into the session's spool file, creating it on first use
+bool spool_data(SmtpSession &session) {
+    if (session.spool_fd < 0) {
+        session.spool_path = spool_path(unique_id());
+        session.spool_fd = open(session.spool_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (session.spool_fd < 0) return false;
+    }
+    bool ok = write_all(session.spool_fd, session.data_body.data(), session.data_body.size());
+    session.data_body.clear();
+    return ok;
+}
+
+// Keep message text exactly as it came over the wire (still dot-stuffed): a
+// line without its line end, or a block of whole CRLF lines. After an error
+// the rest of the message is read and dropped.
+void store_data(SmtpSession &session, string_view text, bool add_line_end) {
+    session.data_size += text.size() + (add_line_end ? 2 : 0);
+    if (session.data_error) return;
+    if (session.data_size > max_message_size) {
+        session.data_error = MESSAGE_TOO_LARGE;
+        session.data_body.clear();
+        session.discard_spool();
+        return;
+    }
+    session.data_body += text;
+    if (add_line_end) session.data_body += "\r\n";
+    if (session.data_body.size() >= SPOOL_BUFFER && !spool_data(session)) {
+        session.data_error = LOCAL_ERROR;
+        session.discard_spool();
+    }
+}
+
+// Reply to the final dot once the delivery writer has made the message durable
+void finish_delivery(SmtpSession &session, bool ok) {
+    uint64_t now = now_us();
+    observe(SMTP_COMMIT, now - session.data_finished);
+    if (session.transaction_started) {
+        observe(SMTP_TRANSACTION, now - session.transaction_started);
+    }
+    session.transaction_started = now;
+    if (ok) {
+        send_response(session, "250 OK Message accepted for delivery");
+    } else {
+        send_response(session, LOCAL_ERROR);
+    }
+    reset_transaction(session);
+    session.paused = false;
+}
+
+// Handle one line (a command, or one line of DATA) from an SMTP client
+void handle_smtp_client(SmtpSession &session, string_view line) {
+    LOG(LogLevel::TRACE, "SMTP Client Recv: %.*s", (int)line.size(), line.data());
+
+    if (session.in_data_mode) {
+        if (line == ".") {
+            session.in_data_mode = false;
+            if (!session.data_error && session.spool_fd >= 0 && !spool_data(session)) {
+                session.data_error = LOCAL_ERROR;
+            }
+            if (session.data_error) {
+                send_response(session, session.data_error);
+                reset_transaction(session);
+                return;
+            }
+
+            // Save the received body content (which includes headers) once for
+            // all recipients. The session stops reading commands until every
+            // recipient's copy is committed, and then replies for all of them.
+            session.paused = true;
+            session.data_finished = now_us();
+            EventLoop *loop = session.loop;
+            int fd = session.fd;
+            uint64_t id = session.id;
+            shared_ptr<MessageBody> body;
+            if (session.spool_fd < 0) {
+                body = make_shared<MessageBody>(move(session.data_body), session.envelope.recipients());
+            } else {
+                // The body takes the spool file over
+                body = make_shared<MessageBody>(session.spool_fd, session.spool_path, session.data_size,
+                                                session.envelope.recipients());
+                session.spool_fd = -1;
+                session.spool_path.clear();
+            }
+            body->summary = move(session.summary.summary);
+            auto pending = make_shared<atomic<size_t>>(session.envelope.recipients());
+            auto failed = make_shared<atomic<bool>>(false);
+            for (size_t i = 0; i < session.envelope.recipients(); ++i) {
+                delivery_writer->submit({string(session.envelope.recipient(i)), body, [loop, fd, id, pending, failed](bool ok) {
+                    if (!ok) *failed = true;
+                    if (--*pending == 0) post_delivery_result(loop, fd, id, !*failed);
+                }, nullptr});
+            }
+        } else {
+            session.summary.add_line(line);
+            store_data(session, line, true);
+        }
+        return;
+    }
+
+    Command command = parse_command(line);
+    count_command(Protocol::SMTP, command.verb);
+
+    switch (command.verb) {
+    case Verb::HELO:
+        session.transaction_started = now_us();
+        send_response(session, "250 Hello");
+        break;
+    case Verb::EHLO:
+        // Advertise RFC 2920 so clients may send a whole envelope in one write
+        session.transaction_started = now_us();
+        send_response(session, "250-localhost Hello");
+        queue_output(session, "250-SIZE ");
+        append_number(output_buffer(session), max_message_size);
+        queue_output(session, "\r\n");
+        send_response(session, "250 PIPELINING");
+        break;
+    case Verb::MAIL: {
+        // RFC 1870: refuse a declared size up front, before any DATA is sent
+        string_view argument = command.argument;
+        for (size_t pos = argument.find(' '); pos != string_view::npos; pos = argument.find(' ', pos + 1)) {
+            string_view parameter = argument.substr(pos + 1);
+            long long declared = 0;
+            if (parameter.size() > 5 && strncasecmp(parameter.data(), "SIZE=", 5) == 0) {
+                parameter.remove_prefix(5);
+                if (take_number(parameter, declared) && (uint64_t)declared > max_message_size) {
+                    // No transaction: RCPT and DATA pipelined behind it get 503
+                    reset_transaction(session);
+                    send_response(session, MESSAGE_TOO_LARGE);
+                    return;
+                }
+            }
+        }
+        // A new MAIL starts a new transaction
+        session.envelope.set_sender(parse_path(argument, "FROM:"));
+        send_response(session, "250 Sender OK");
+        break;
+    }
+    case Verb::RCPT: {
+        if (!session.envelope.has_sender()) {
+            send_response(session, BAD_SEQUENCE);
+            return;
+        }
+        string_view mailbox = parse_path(command.argument, "TO:");
+        if (mailbox.empty()) {
+            send_response(session, "501 Syntax error in parameters or arguments");
+            return;
+        }
+        if (!valid_mailbox_name(mailbox)) {
+            send_response(session, "553 Mailbox name not allowed");
+            return;
+        }
+        if (session.envelope.recipients() >= MAX_RECIPIENTS) {
+            send_response(session, "452 Too many recipients");
+            return;
+        }
+        session.envelope.add_recipient(mailbox);
+        send_response(session, "250 Recipient OK");
+        break;
+    }
+    case Verb::DATA:
+        if (!session.envelope.has_sender()) {
+            send_response(session, BAD_SEQUENCE);
+            return;
+        }
+        if (session.envelope.recipients() == 0) {
+            send_response(session, "503 Need RCPT command first");
+            return;
+        }
+        session.in_data_mode = true;
+        send_response(session, "354 Start mail input; end with <CRLF>.<CRLF>");
+        break;
+    case Verb::RSET:
+        reset_transaction(session);
+        send_response(session, "250 OK");
+        break;
+    case Verb::NOOP:
+        send_response(session, "250 OK");
+        break;
+    case Verb::QUIT:
+        send_response(session, "221 Bye");
+        session.closing = true;
+        break;
+    default:
+        send_response(session, "500 Syntax error, command unrecognized");
+    }
+}
+
+// --- Event Loop ---
+
+struct Listener {
+    int fd;
+    Protocol protocol;
+};
+
+// Create a non-blocking listening socket for one protocol. Every shard binds
+// its own socket to the port; with SO_REUSEPORT the kernel hashes incoming
+// connections across them, so shards never contend on a shared accept queue.
+int open_listener(const char* name, int port, int backlog) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        LOG(LogLevel::ERROR, "%s Socket creation failed: %s", name, strerror(errno));
+        return -1;
+    }
+    // Separate calls: the option names are numbers, not flags
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        LOG(LogLevel::ERROR, "%s setsockopt: %s", name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        LOG(LogLevel::ERROR, "%s Bind failed. Check if port %d is already in use.", name, port);
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, backlog) < 0) {
+        LOG(LogLevel::ERROR, "%s listen failed: %s", name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    LOG(LogLevel::DEBUG, "%s listener bound on port %d", name, port);
+    return server_fd;
+}
+
+// Parse a CPU list such as "0,2,4-7"; "auto" means every CPU this process may use
+bool parse_cpu_list(const string &spec, vector<int> &cpus) {
+    cpus.clear();
+    if (spec == "auto") {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+        return !cpus.empty();
+    }
+    stringstream in(spec);
+    string range;
+    while (getline(in, range, ',')) {
+        char *end = nullptr;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (end == range.c_str()) return false;
+        if (*end == '-') {
+            const char *second = end + 1;
+            last = strtol(second, &end, 10);
+            if (end == second) return false;
+        }
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+// Pin the calling thread to one CPU
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        LOG(LogLevel::WARN, "Could not pin to CPU %d: %s", cpu, strerror(err));
+    }
+}
+
+// --- Admission and Timeouts ---
+//
+// Sessions are capped per protocol across all shards, and a client over the
+// cap gets a 421/-ERR and is closed at once. Every session also idles out:
+// the timeout depends on its state (waiting for the first command, between
+// commands, inside DATA), and during DATA the client must keep up a minimum
+// throughput, so a slowloris cannot hold a session by trickling bytes.
+
+struct SessionLimits {
+    size_t max_sessions[2] = {10000, 10000};  // By Protocol; 0 = no cap
+    unsigned greeting_timeout = 60;  // Seconds from the greeting to the first command
+    unsigned smtp_timeout = 300;     // Between SMTP commands (RFC 5321 4.5.3.2.7)
+    unsigned pop3_timeout = 600;     // POP3 autologout (RFC 1939 section 3)
+    unsigned data_timeout = 180;     // Between data blocks in DATA (RFC 5321 4.5.3.2.5)
+    uint64_t min_data_rate = 1024;   // Bytes per second during DATA; 0 = no floor
+};
+
+// Set once at startup from the command line
+SessionLimits session_limits;
+
+// Length of the window DATA throughput is measured over
+const uint64_t DATA_RATE_WINDOW_MS = 10000;
+
+// Open sessions per protocol, across every shard
+atomic<size_t> active_sessions[2];
+
+uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+// A hierarchical timing wheel (Varghese and Lauck): LEVELS wheels of SLOTS
+// slots, where a slot of level i spans SLOTS^i ticks. Adding a timer and
+// firing one cost O(1); a timer far in the future waits in a coarse slot and
+// cascades down a level as its time comes closer, so a shard holding
+// thousands of idle sessions does constant work per tick. Timers are never
+// cancelled: the owner checks on firing whether the timer is still current.
+class TimerWheel {
+public:
+    static const uint64_t TICK_MS = 100;
+
+    struct Timer {
+        uint64_t due_ms;
+        int fd;
+        uint64_t id;  // Connection id, so a reused fd is not mistaken for the old session
+    };
+
+    explicit TimerWheel(uint64_t now_ms) : now_tick(now_ms / TICK_MS) {}
+
+    bool empty() const { return count == 0; }
+
+    void add(const Timer &timer) {
+        insert(timer);
+        ++count;
+    }
+
+    // Move time forward to 'now_ms', collecting every timer that came due
+    void advance(uint64_t now_ms, vector<Timer> &expired) {
+        uint64_t target = now_ms / TICK_MS;
+        while (now_tick < target && count > 0) {
+            ++now_tick;
+            // Each time a level wraps, the next level's current slot falls due
+            for (int level = 1; level < LEVELS; ++level) {
+                if ((now_tick & ((1ull << (BITS * level)) - 1)) != 0) break;
+                vector<Timer> moving;
+                moving.swap(slots[level][(now_tick >> (BITS * level)) & MASK]);
+                for (const Timer &timer : moving) insert(timer);
+            }
+            vector<Timer> &slot = slots[0][now_tick & MASK];
+            expired.insert(expired.end(), slot.begin(), slot.end());
+            count -= slot.size();
+            vector<Timer>().swap(slot);
+        }
+        now_tick = max(now_tick, target);
+    }
+
+private:
+    static const int BITS = 6;
+    static const int LEVELS = 4;  // 64^4 ticks of 100 ms: about 19 days
+    static const uint64_t MASK = (1 << BITS) - 1;
+
+    vector<Timer> slots[LEVELS][1 << BITS];
+    uint64_t now_tick;
+    size_t count = 0;
+
+    void insert(const Timer &timer) {
+        // Round up so a timer never fires early; beyond the top level's span
+        // it fires at the end of the span and its owner re-arms it
+        uint64_t tick = max((timer.due_ms + TICK_MS - 1) / TICK_MS, now_tick + 1);
+        tick = min<uint64_t>(tick, now_tick + (1ull << (BITS * LEVELS)) - 1);
+        uint64_t delta = tick - now_tick;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << (BITS * (level + 1)))) ++level;
+        slots[level][(tick >> (BITS * level)) & MASK].push_back(timer);
+    }
+};
+
+// A single-threaded epoll reactor. Each loop is one shard: it accepts from its
+// own SMTP and POP3 listening sockets and runs the sessions it accepted to
+// completion, so no connection ever needs its own thread.
+class EventLoop {
+public:
+    explicit EventLoop(const vector<Listener> &listeners)
+        : listeners(listeners), clock_ms(now_ms()), timers(clock_ms) {
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (io_backend == IoBackend::URING && start_ring()) return;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event wake = {};
+        wake.events = EPOLLIN;
+        wake.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake);
+        for (const Listener &listener : listeners) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = listener.fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener.fd, &ev);
+        }
+    }
 
-// Send a response string to the client
-void send_response(int socket, const string &msg) {
-    string full_msg = msg + "\r\n";
-    send(socket, full_msg.c_str(), full_msg.length(), 0);
-    cout << "Server Sent: " << msg << endl;
-}
+    ~EventLoop() {
+        close(wake_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (spare_fd >= 0) close(spare_fd);
+    }
 
-// Function to safely extract a field (like recipient email)
-string extract_field(const string& command, const string& prefix) {
-    size_t start = command.find(prefix);
-    if (start != string::npos) {
-        // Find the start of the address (after the prefix)
-        start += prefix.length();
-        // Trim leading spaces
-        start = command.find_first_not_of(" <", start);
-        // Find the end of the address (before >)
-        size_t end = command.find('>', start);
-        if (end != string::npos) {
-            return command.substr(start, end - start);
+    // Run a task on this loop's thread; safe to call from any thread
+    void post(function<void()> task) {
+        {
+            lock_guard<mutex> guard(tasks_lock);
+            tasks.push_back(move(task));
         }
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
     }
-    return "";
-}
 
-string clean_email_for_filename(const string& email) {
-    string cleaned = email;
-    // Remove leading '<'
-    if (!cleaned.empty() && cleaned.front() == '<') {
-        cleaned.erase(0, 1);
+    // Deliver a background result (an SMTP delivery or a POP3 update) to a
+    // session if it is still connected
+    void complete_delivery(int fd, uint64_t id, bool ok) {
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second->id != id) return;
+        Connection &conn = *it->second;
+        if (conn.protocol == Protocol::SMTP) {
+            finish_delivery(static_cast<SmtpSession &>(conn), ok);
+        } else {
+            finish_update(static_cast<Pop3Session &>(conn), ok);
+        }
+        conn.last_active_ms = clock_ms;
+        resume_client(conn);
     }
-    // Remove trailing '>'
-    if (!cleaned.empty() && cleaned.back() == '>') {
-        cleaned.pop_back();
+
+    void run() {
+        if (ring) {
+            run_ring();
+            return;
+        }
+        struct epoll_event events[256];
+        while (true) {
+            int n = epoll_wait(epoll_fd, events, 256, timers.empty() ? -1 : (int)TimerWheel::TICK_MS);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG(LogLevel::ERROR, "epoll_wait: %s", strerror(errno));
+                return;
+            }
+            clock_ms = now_ms();
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd) {
+                    run_tasks();
+                    continue;
+                }
+                const Listener *listener = find_listener(fd);
+                if (listener) {
+                    accept_clients(*listener);
+                    continue;
+                }
+
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                Connection &conn = *it->second;
+
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    if (!read_client(conn)) {
+                        close_client(conn);
+                        continue;
+                    }
+                }
+                if (!flush_client(conn)) {
+                    close_client(conn);
+                    continue;
+                }
+                arm_timer(conn);
+            }
+            expire_timers();
+        }
     }
-    return cleaned;
-}
 
-// --- POP3 Mail Retrieval Logic ---
+private:
+    int epoll_fd = -1;
+    int wake_fd;
+    unique_ptr<IoUring> ring;  // Instead of epoll, with the io_uring backend
+    unordered_map<uint64_t, SendBatch> orphans;  // Output of closed sessions still in use by the kernel
+    vector<Listener> listeners;
+    unordered_map<int, unique_ptr<Connection>> connections;
+    uint64_t next_id = 0;
+    mutex tasks_lock;
+    vector<function<void()>> tasks;
+    uint64_t clock_ms;   // Read once per wakeup, not per socket operation
+    TimerWheel timers;   // One live timer per connection
+    int spare_fd;        // Given up to accept-and-close when out of descriptors
 
-// Structure to hold one email's contents
-struct Mail {
-    string content;
-};
+    // How long the session may stay silent in its current state
+    uint64_t idle_limit_ms(Connection &conn) const {
+        if (conn.greeted) return session_limits.greeting_timeout * 1000ull;
+        if (conn.protocol == Protocol::POP3) return session_limits.pop3_timeout * 1000ull;
+        if (static_cast<SmtpSession &>(conn).in_data_mode) return session_limits.data_timeout * 1000ull;
+        return session_limits.smtp_timeout * 1000ull;
+    }
 
-// Function to load all emails for a user from their file
-vector<Mail> load_mailbox(const string& username) {
-    vector<Mail> mailbox;
-    string filename = username + ".txt";
-    ifstream infile(filename);
-    string line;
-    string current_email_content;
-
-    // A unique delimiter to split emails within the file
-    const string DELIMITER = "--- END OF MESSAGE ---";
-
-    // Read the file line by line
-    while (getline(infile, line)) {
-        if (line == DELIMITER) { 
-            if (!current_email_content.empty()) {
-                // Remove trailing \n added from the final line of the body
-                if (current_email_content.back() == '\n') {
-                    current_email_content.pop_back();
+    // When the session next needs looking at: its idle deadline, or the end
+    // of the current DATA throughput window if that comes first
+    uint64_t next_due(Connection &conn) {
+        uint64_t due = conn.last_active_ms + idle_limit_ms(conn);
+        if (conn.protocol == Protocol::SMTP) {
+            SmtpSession &session = static_cast<SmtpSession &>(conn);
+            if (!session.in_data_mode || session_limits.min_data_rate == 0) {
+                session.rate_check_ms = 0;
+            } else {
+                if (session.rate_check_ms == 0) {
+                    session.rate_check_ms = clock_ms + DATA_RATE_WINDOW_MS;
+                    session.rate_mark = conn.bytes_in;
                 }
-                mailbox.push_back({current_email_content});
+                due = min(due, session.rate_check_ms);
             }
-            current_email_content.clear();
-        } else {
-            // Append the line and add the newline back
-            current_email_content += line + "\n";
+        }
+        return due;
+    }
+
+    // Make sure a timer is pending no later than the session's next deadline.
+    // A later timer already in the wheel goes stale and is skipped when it fires.
+    void arm_timer(Connection &conn) {
+        uint64_t due = next_due(conn);
+        if (conn.timer_ms == 0 || due < conn.timer_ms) {
+            timers.add({due, conn.fd, conn.id});
+            conn.timer_ms = due;
         }
     }
-    return mailbox;
-}
 
-void handle_pop3_client(int client_socket) {
-    send_response(client_socket, "+OK POP3 Server ready");
+    void expire_timers() {
+        vector<TimerWheel::Timer> expired;
+        timers.advance(clock_ms, expired);
+        for (const TimerWheel::Timer &timer : expired) {
+            auto it = connections.find(timer.fd);
+            if (it == connections.end() || it->second->id != timer.id || it->second->timer_ms != timer.due_ms) {
+                continue;  // Closed, or superseded by an earlier timer
+            }
+            Connection &conn = *it->second;
+            conn.timer_ms = 0;
+            if (conn.paused) {
+                // Waiting on our own delivery, not on the client
+                conn.last_active_ms = clock_ms;
+            } else if (conn.protocol == Protocol::SMTP && !check_data_rate(static_cast<SmtpSession &>(conn))) {
+                LOG(LogLevel::INFO, "Evicting slow SMTP client (fd %d)", conn.fd);
+                count(SLOW_EVICTIONS);
+                evict(conn, "421 4.4.2 localhost Data transfer too slow, closing connection");
+                continue;
+            } else if (clock_ms >= conn.last_active_ms + idle_limit_ms(conn)) {
+                LOG(LogLevel::DEBUG, "%s session timed out (fd %d)",
+                    conn.protocol == Protocol::SMTP ? "SMTP" : "POP3", conn.fd);
+                count(SESSION_TIMEOUTS);
+                evict(conn, conn.protocol == Protocol::SMTP ? "421 4.4.2 localhost Error: timeout exceeded"
+                                                             : "-ERR Timeout, closing connection");
+                continue;
+            }
+            arm_timer(conn);
+        }
+    }
 
-    string username;
-    bool logged_in = false;
-    vector<Mail> mailbox;
+    // At the end of a DATA throughput window: did the client send enough?
+    bool check_data_rate(SmtpSession &session) {
+        if (session.rate_check_ms == 0 || clock_ms < session.rate_check_ms) return true;
+        uint64_t received = session.bytes_in - session.rate_mark;
+        if (received * 1000 < session_limits.min_data_rate * DATA_RATE_WINDOW_MS) return false;
+        session.rate_check_ms = clock_ms + DATA_RATE_WINDOW_MS;
+        session.rate_mark = session.bytes_in;
+        return true;
+    }
 
-    // Main POP3 Session Loop
-    while (true) {
-        char buffer[1024] = {0};
-        int bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0) break;
+    // Tell the client why and drop it without waiting for it to read the reply
+    void evict(Connection &conn, const char *reply) {
+        send_response(conn, reply);
+        flush_client(conn);
+        close_client(conn);
+    }
 
-        string command(buffer);
-        // Clean up command: remove trailing whitespace and \r\n
-        command.erase(command.find_last_not_of(" \r\n") + 1);
-        cout << "POP3 Client Recv: " << command << endl;
+    void run_tasks() {
+        uint64_t count;
+        read(wake_fd, &count, sizeof(count));
+        vector<function<void()>> ready;
+        {
+            lock_guard<mutex> guard(tasks_lock);
+            ready.swap(tasks);
+        }
+        for (auto &task : ready) {
+            task();
+        }
+    }
 
-        string verb = command.substr(0, command.find(' '));
-        // Convert command verb to uppercase
-        std::transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+    // Pick a session back up after it was paused: run the lines that queued
+    // up meanwhile, read whatever the socket still holds, and send the replies
+    void resume_client(Connection &conn) {
+        if (!process_lines(conn) || !read_client(conn) || !flush_client(conn)) {
+            close_client(conn);
+            return;
+        }
+        arm_timer(conn);
+    }
 
-        if (verb == "QUIT") {
-            send_response(client_socket, "+OK Bye");
-            break;
+    const Listener *find_listener(int fd) const {
+        for (const Listener &listener : listeners) {
+            if (listener.fd == fd) return &listener;
         }
+        return nullptr;
+    }
 
-        if (!logged_in) {
-            if (verb == "USER") {
-                // For simplicity, we assume the USER command contains the full email address
-                username = command.substr(command.find(' ') + 1);
-                send_response(client_socket, "+OK User name accepted, password please");
-            } else if (verb == "PASS") {
-                if (!username.empty()) {
-                    // Load the mailbox based on the username provided
-                    mailbox = load_mailbox(username);
-                    logged_in = true;
-                    // Just send a simple +OK, don't include STAT info here
-                    send_response(client_socket, "+OK Logged in");
-                } else {
-                    send_response(client_socket, "-ERR USER command required first");
+    void accept_clients(const Listener &listener) {
+        while (true) {
+            int client_fd = accept4(listener.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0 && (errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                refuse_client(listener);
+                continue;
+            }
+            if (client_fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    LOG(LogLevel::ERROR, "%s accept failed: %s",
+                        listener.protocol == Protocol::SMTP ? "SMTP" : "POP3", strerror(errno));
                 }
-            } else {
-                send_response(client_socket, "-ERR Authentication required");
+                if (errno == EINTR) continue;
+                return;
             }
+            add_client(listener, client_fd);
+        }
+    }
+
+    // Out of descriptors: free the spare to accept and close the client, or
+    // the listener would wake us forever
+    void refuse_client(const Listener &listener) {
+        close(spare_fd);
+        int client_fd = accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd >= 0) close(client_fd);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        LOG(LogLevel::WARN, "Out of file descriptors, refusing a connection");
+        count(listener.protocol == Protocol::SMTP ? SMTP_REJECTED : POP3_REJECTED);
+    }
+
+    // Admit a newly accepted client and greet it
+    void add_client(const Listener &listener, int client_fd) {
+        // Admission: over the cap, say why and close straight away
+        atomic<size_t> &active = active_sessions[(int)listener.protocol];
+        size_t limit = session_limits.max_sessions[(int)listener.protocol];
+        if (limit > 0 && active.fetch_add(1) >= limit) {
+            --active;
+            const char *reply = listener.protocol == Protocol::SMTP
+                                    ? "421 4.3.2 localhost Too many connections, try again later\r\n"
+                                    : "-ERR [SYS/TEMP] Too many connections, try again later\r\n";
+            send(client_fd, reply, strlen(reply), MSG_NOSIGNAL);
+            close(client_fd);
+            count(listener.protocol == Protocol::SMTP ? SMTP_REJECTED : POP3_REJECTED);
+            return;
+        }
+        if (limit == 0) ++active;
+
+        unique_ptr<Connection> conn;
+        if (listener.protocol == Protocol::SMTP) {
+            LOG(LogLevel::DEBUG, "SMTP client connected");
+            conn.reset(new SmtpSession(client_fd));
+            send_response(*conn, "220 localhost Simple SMTP Server");
         } else {
-            // Commands requiring authentication
-            if (verb == "STAT") {
-                // Returns number of messages and total size (size estimate)
-                int total_size = 0;
-                for (const auto& mail : mailbox) {
-                    total_size += mail.content.length();
-                }
-                send_response(client_socket, "+OK " + to_string(mailbox.size()) + " " + to_string(total_size));
-            } else if (verb == "LIST") {
-                // Lists message numbers and sizes
-                string list_response = "+OK Mailbox scan listing follows";
-                for (size_t i = 0; i < mailbox.size(); ++i) {
-                    list_response += "\r\n" + to_string(i + 1) + " " + to_string(mailbox[i].content.length());
-                }
-                list_response += "\r\n."; // POP3 termination dot
-                // Send LIST response as a single block
-                string full_msg = list_response + "\r\n";
-                send(client_socket, full_msg.c_str(), full_msg.length(), 0);
-                cout << "Server Sent: [LIST Response]" << endl;
-            } else if (verb == "RETR") {
-                // Retrieve email by index
-                int msg_num = 0;
-                try {
-                    msg_num = stoi(command.substr(command.find(' ') + 1));
-                } catch (...) {
-                    send_response(client_socket, "-ERR Invalid message number");
+            LOG(LogLevel::DEBUG, "POP3 client connected");
+            conn.reset(new Pop3Session(client_fd));
+            send_response(*conn, "+OK POP3 Server ready");
+        }
+        conn->loop = this;
+        conn->id = ++next_id;
+        conn->last_active_ms = clock_ms;
+        if (!watch_client(*conn)) {
+            close(client_fd);
+            --active;
+            return;
+        }
+        count(listener.protocol == Protocol::SMTP ? SMTP_ACCEPTED : POP3_ACCEPTED);
+        Connection &ref = *conn;
+        connections[client_fd] = move(conn);
+        if (!flush_client(ref)) {
+            close_client(ref);
+        } else {
+            arm_timer(ref);
+        }
+    }
+
+    // Start listening to a new client. With epoll it is registered
+    // edge-triggered for both directions: we always drain reads and writes
+    // until EAGAIN, so the registration never has to change. With io_uring
+    // one multishot receive delivers everything it sends.
+    bool watch_client(Connection &conn) {
+        if (ring) return arm_recv(conn);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = conn.fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+            LOG(LogLevel::ERROR, "epoll_ctl: %s", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Drain the socket into the session's input buffer and run every complete
+    // line through the protocol handler. Replies for a pipelined batch collect
+    // in 'out' and go back in a single write. Returns false when the
+    // connection should be torn down.
+    bool read_client(Connection &conn) {
+        // With io_uring bytes arrive as receive completions instead; a
+        // receive stopped while the session was paused starts again
+        if (ring) return conn.paused || conn.receiving || arm_recv(conn);
+        char buffer[16384];
+        while (!conn.closing && !conn.paused) {
+            ssize_t bytes_received = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (bytes_received == 0) return false;
+            if (bytes_received < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (!receive(conn, buffer, bytes_received)) return false;
+        }
+        return true;
+    }
+
+    // Take bytes the client sent and run the complete lines among them
+    bool receive(Connection &conn, const char *data, size_t len) {
+        if (conn.closing) return true;
+        count(BYTES_RECEIVED, len);
+        conn.bytes_in += len;
+        conn.last_active_ms = clock_ms;
+        conn.in.feed(data, len);
+        return process_lines(conn);
+    }
+
+    // Frame conn.in into CRLF-terminated lines (a bare LF is tolerated) and
+    // dispatch them. A partial line stays buffered until the rest arrives.
+    bool process_lines(Connection &conn) {
+        string_view line;
+        while (!conn.closing && !conn.paused) {
+            // Past the headers of DATA, a run of lines none of which starts
+            // with a dot (the end, or a stuffed line) or ends in a bare LF is
+            // stored as it came, in one piece
+            if (conn.protocol == Protocol::SMTP) {
+                SmtpSession &session = static_cast<SmtpSession &>(conn);
+                if (session.in_data_mode && !session.summary.in_headers && conn.in.next_lines(line, '.')) {
+                    LOG(LogLevel::TRACE, "SMTP Client Recv: [%zu bytes of DATA]", line.size());
+                    store_data(session, line, false);
                     continue;
                 }
+            }
+            if (!conn.in.next_line(line)) break;
+            conn.greeted = false;
+#ifdef COUNT_ALLOCATIONS
+            uint64_t allocations = thread_allocations;
+#endif
+            if (conn.protocol == Protocol::SMTP) {
+                handle_smtp_client(static_cast<SmtpSession &>(conn), line);
+            } else {
+                handle_pop3_client(static_cast<Pop3Session &>(conn), line);
+            }
+#ifdef COUNT_ALLOCATIONS
+            count(HANDLER_ALLOCATIONS, thread_allocations - allocations);
+#endif
+        }
 
-                if (msg_num > 0 && msg_num <= (int)mailbox.size()) {
-                    string email_content = mailbox[msg_num - 1].content;
-                    
-                    string success_msg = "+OK " + to_string(email_content.length()) + " octets";
-                    
-                    // 2. Build final response: Header + CRLF + Content + CRLF + Dot + CRLF
-                    string full_response = success_msg + "\r\n";
-                    full_response += email_content; // Content (ends in \n from load_mailbox)
-                    
-                    // Append the dot terminator: POP3 requires a line with just a dot, followed by CRLF
-                    full_response += ".\r\n"; 
-
-                    send(client_socket, full_response.c_str(), full_response.length(), 0);
-                    cout << "Server Sent: [Full Email Content]" << endl;
-                } else {
-                    send_response(client_socket, "-ERR No such message");
+        // Refuse to buffer an endless line. Only the unterminated tail counts:
+        // a paused session holds complete lines until it resumes, and those
+        // are capped as a whole.
+        if (conn.in.overflow()) {
+            send_response(conn, conn.protocol == Protocol::SMTP ? "500 Line too long" : "-ERR Line too long");
+            conn.closing = true;
+        } else if (conn.paused && conn.in.pending() > MAX_PAUSED_INPUT) {
+            LOG(LogLevel::WARN, "Client kept sending while its session was paused (fd %d)", conn.fd);
+            send_response(conn, conn.protocol == Protocol::SMTP ? "421 4.7.0 localhost Too much pipelined input"
+                                                                 : "-ERR Too much pipelined input");
+            conn.closing = true;
+        }
+        conn.in.release(KEPT_BUFFER);
+        return true;
+    }
+
+    // Write as much pending output as the socket accepts. Returns false when
+    // the connection is finished or broken.
+    bool flush_client(Connection &conn) {
+        if (ring) {
+            if (!stage_output(conn)) return false;
+            if (conn.io_busy) return true;  // Its completion flushes again
+            if (conn.sending.chunks.capacity() > KEPT_CHUNKS) {
+                vector<OutputChunk>().swap(conn.sending.chunks);
+                vector<struct iovec>().swap(conn.sending.iov);
+            }
+        }
+        if (!ring) {
+            bool corked = false;
+            bool ok = write_output(conn, corked);
+            if (corked) {
+                int off = 0;
+                setsockopt(conn.fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+            }
+            if (!ok) return false;
+            if (conn.out_head < conn.out.size()) return true;  // Socket full; EPOLLOUT resumes
+        }
+        reset_output(conn);
+        if (conn.protocol == Protocol::POP3) {
+            Pop3Session &session = static_cast<Pop3Session &>(conn);
+            if (session.retr_started) {
+                observe(POP3_RETR, now_us() - session.retr_started);
+                session.retr_started = 0;
+            }
+        }
+        return !conn.closing;
+    }
+
+    static constexpr int MAX_WRITE_IOVECS = 64;  // Chunks gathered into one sendmsg()
+
+    // Write pending output until it is gone or the socket is full. A run of
+    // in-memory chunks (replies, cached bodies) goes out in one sendmsg()
+    // that points at them where they are. File ranges go through sendfile();
+    // one with more output after it is sent with the socket corked, which
+    // 'corked' reports so the caller uncorks once done, so the +OK line, the
+    // body and the final dot fill whole packets instead of trailing small ones.
+    bool write_output(Connection &conn, bool &corked) {
+        while (conn.out_head < conn.out.size()) {
+            OutputChunk &chunk = conn.out[conn.out_head];
+            ssize_t sent;
+            if (chunk.file_fd >= 0) {
+                if (!corked && conn.out_head + 1 < conn.out.size()) {
+                    int on = 1;
+                    corked = setsockopt(conn.fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
                 }
+                sent = chunk.length ? sendfile(conn.fd, chunk.file_fd, &chunk.offset, chunk.length) : 0;
+                if (sent > 0) chunk.length -= sent;
+                // A file that shrank underneath us would otherwise never finish
+                if (sent == 0 && chunk.length > 0) return false;
             } else {
-                send_response(client_socket, "-ERR Unknown command");
+                struct iovec iov[MAX_WRITE_IOVECS];
+                int count_iov = 0;
+                bool more = false;  // A file range follows; let the kernel hold a partial packet for it
+                for (size_t i = conn.out_head; i < conn.out.size() && count_iov < MAX_WRITE_IOVECS; ++i) {
+                    const OutputChunk &next = conn.out[i];
+                    if (next.file_fd >= 0) {
+                        more = true;
+                        break;
+                    }
+                    const string &bytes = next.shared ? *next.shared : next.data;
+                    iov[count_iov].iov_base = (void *)(bytes.data() + next.offset);
+                    iov[count_iov].iov_len = bytes.size() - next.offset;
+                    ++count_iov;
+                }
+                struct msghdr msg = {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count_iov;
+                sent = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            }
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            count(SOCKET_WRITES);
+            count(BYTES_SENT, sent);
+            if (sent > 0) conn.last_active_ms = clock_ms;
+            if (chunk.file_fd >= 0) {
+                if (chunk.length == 0) {
+                    if (chunk.owns_fd) close(chunk.file_fd);
+                    chunk.owns_fd = false;
+                    ++conn.out_head;
+                }
+                continue;
+            }
+            // Step past what sendmsg() took, which may end inside a chunk
+            size_t left = sent;
+            while (conn.out_head < conn.out.size() && conn.out[conn.out_head].file_fd < 0) {
+                OutputChunk &done = conn.out[conn.out_head];
+                size_t pending = (done.shared ? done.shared->size() : done.data.size()) - done.offset;
+                if (left < pending) {
+                    done.offset += left;
+                    break;
+                }
+                left -= pending;
+                done.offset += pending;
+                ++conn.out_head;
             }
         }
+        return true;
     }
 
-    close(client_socket);
-}
+    // Everything in 'out' was written. A buffer of a few replies is kept for
+    // the next ones; anything bigger is released so idle sessions stay small.
+    void reset_output(Connection &conn) {
+        if (conn.out.size() == 1 && conn.out[0].file_fd < 0 && !conn.out[0].shared &&
+            conn.out[0].data.capacity() <= KEPT_BUFFER) {
+            conn.out[0].data.clear();
+            conn.out[0].offset = 0;
+        } else {
+            vector<OutputChunk>().swap(conn.out);
+        }
+        conn.out_head = 0;
+    }
 
-// Thread function for the POP3 Listener
-void pop3_listener() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    const int POP3_PORT = 8110; 
-    int opt = 1;
+    void close_client(Connection &conn) {
+        count(conn.protocol == Protocol::SMTP ? SMTP_CLOSED : POP3_CLOSED);
+        --active_sessions[(int)conn.protocol];
+        int fd = conn.fd;
+        if (ring) {
+            // Issue whatever is queued for the socket while its number is
+            // still ours, then end its multishot receive by shutting it down.
+            // A send or read in flight keeps its buffer until it completes.
+            if (ring->has_queued()) ring->submit();
+            shutdown(fd, SHUT_RDWR);
+            if (conn.io_busy) orphans[io_key(io_tag(IoOp::SEND, fd, conn.id))] = move(conn.sending);
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        close(fd);
+        connections.erase(fd);
+    }
 
-    // Socket creation and setup
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        cerr << "POP3 Socket creation failed" << endl;
-        return;
+    // The io_uring backend
+
+    // What a completion is for. The tag in its user data also carries the
+    // descriptor and the low bits of the session id, so a completion for a
+    // closed session is never mistaken for one of a newer session that got
+    // the same descriptor.
+    enum class IoOp : uint8_t { ACCEPT, WAKE, RECV, SEND, READ, CANCEL };
+    static constexpr uint64_t TAG_ID_MASK = 0xffffff;
+
+    static constexpr unsigned RING_ENTRIES = 1024;
+    static constexpr uint16_t RECV_GROUP = 0;
+    static constexpr unsigned RECV_BUFFERS = 128;        // Shared by all sessions of the loop
+    static constexpr unsigned RECV_BUFFER_SIZE = 16384;
+    static constexpr size_t FILE_READ_SIZE = 64 * 1024;  // Message file bytes read per send
+    static constexpr size_t KEPT_CHUNKS = 4;  // Send batch slots a session keeps once drained
+
+    static uint64_t io_tag(IoOp op, int fd, uint64_t id) {
+        return (uint64_t)op << 56 | (id & TAG_ID_MASK) << 32 | (uint32_t)fd;
     }
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("POP3 setsockopt");
-        return;
+    static uint64_t io_key(uint64_t tag) { return tag & ((1ull << 56) - 1); }
+
+    // Set up the ring and arm the listeners and the wake-up descriptor on it;
+    // false leaves this loop on epoll
+    bool start_ring() {
+        string error = "cannot register receive buffers";
+        ring.reset(new IoUring);
+        if (!ring->open(RING_ENTRIES, error) || !ring->provide_buffers(RECV_GROUP, RECV_BUFFERS, RECV_BUFFER_SIZE)) {
+            LOG(LogLevel::WARN, "io_uring setup failed (%s), falling back to epoll", error.c_str());
+            ring.reset();
+            return false;
+        }
+        arm_wake();
+        for (const Listener &listener : listeners) {
+            arm_accept(listener);
+        }
+        return true;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(POP3_PORT);
+    // One system call per iteration submits everything the last batch of
+    // completions queued (replies, file reads, re-armed receives) and waits
+    // for the next batch
+    void run_ring() {
+        while (true) {
+            int result = ring->submit(1, timers.empty() ? -1 : (int)TimerWheel::TICK_MS);
+            if (result < 0 && result != -EINTR && result != -ETIME && result != -EAGAIN && result != -EBUSY) {
+                LOG(LogLevel::ERROR, "io_uring_enter: %s", strerror(-result));
+                return;
+            }
+            clock_ms = now_ms();
+            ring->reap([this](const struct io_uring_cqe &cqe) { complete(cqe); });
+            expire_timers();
+        }
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        cerr << "POP3 Bind failed. Check if port " << POP3_PORT << " is already in use." << endl;
-        return;
+    struct io_uring_sqe *queue(IoOp op, int fd, uint64_t id) {
+        struct io_uring_sqe *sqe = ring->next_sqe();
+        if (!sqe) {
+            LOG(LogLevel::ERROR, "io_uring submission queue full");
+            return nullptr;
+        }
+        sqe->fd = fd;
+        sqe->user_data = io_tag(op, fd, id);
+        return sqe;
     }
 
-    if (listen(server_fd, 10) < 0) {
-        perror("POP3 listen failed");
-        return;
+    void arm_wake() {
+        struct io_uring_sqe *sqe = queue(IoOp::WAKE, wake_fd, 0);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    void arm_accept(const Listener &listener) {
+        struct io_uring_sqe *sqe = queue(IoOp::ACCEPT, listener.fd, 0);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
     }
 
-    cout << "POP3 Server listening on port " << POP3_PORT << endl;
+    // Receive into whichever registered buffer is free when data arrives
+    bool arm_recv(Connection &conn) {
+        struct io_uring_sqe *sqe = queue(IoOp::RECV, conn.fd, conn.id);
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_GROUP;
+        conn.receiving = true;
+        conn.recv_cancelled = false;
+        return true;
+    }
 
-    while (true) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0) {
-            perror("POP3 accept failed");
-            continue;
+    // A paused session stops receiving, as it stops reading on epoll, so a
+    // client that keeps sending is held back by TCP flow control rather than
+    // buffered. read_client() arms the receive again once it resumes.
+    void cancel_recv(Connection &conn) {
+        if (!conn.receiving || conn.recv_cancelled) return;
+        struct io_uring_sqe *sqe = queue(IoOp::CANCEL, conn.fd, conn.id);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = io_tag(IoOp::RECV, conn.fd, conn.id);
+        conn.recv_cancelled = true;
+    }
+
+    // Queue the next send of pending output, or the read of the next piece of
+    // a message file. A session has one of them in flight at a time so its
+    // output stays in order; replies queued meanwhile go out in the next send.
+    // Replies and cached bodies are moved into the send batch and sent where
+    // they are, one iovec each. Message file bytes are read through the ring
+    // into a chunk of the batch, up to FILE_READ_SIZE of them per send, so the
+    // +OK line, the message and the final dot of a RETR, and of the RETRs
+    // pipelined after it, go out in one sendmsg rather than one send each.
+    bool stage_output(Connection &conn) {
+        if (conn.io_busy) return true;
+        SendBatch &batch = conn.sending;
+        release_sent(conn);
+        size_t pending = 0;
+        for (const OutputChunk &chunk : batch.chunks) pending += chunk_size(chunk) - chunk.offset;
+        while (conn.out_head < conn.out.size() && batch.chunks.size() < MAX_WRITE_IOVECS) {
+            OutputChunk &chunk = conn.out[conn.out_head];
+            if (chunk.file_fd < 0) {
+                // An empty buffer is left where it is, to be written into again
+                size_t size = chunk_size(chunk) - chunk.offset;
+                if (size > 0) batch.chunks.push_back(move(chunk));
+                pending += size;
+                ++conn.out_head;
+                continue;
+            }
+            if (chunk.length == 0) {
+                if (chunk.owns_fd) close(chunk.file_fd);
+                chunk.owns_fd = false;
+                ++conn.out_head;
+                continue;
+            }
+            if (pending >= FILE_READ_SIZE) break;
+            batch.chunks.emplace_back();
+            string &piece = batch.chunks.back().data;
+            piece.resize(min(chunk.length, FILE_READ_SIZE - pending));
+            struct io_uring_sqe *sqe = queue(IoOp::READ, conn.fd, conn.id);
+            if (!sqe) return false;
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = chunk.file_fd;
+            sqe->addr = (uint64_t)piece.data();
+            sqe->len = piece.size();
+            sqe->off = chunk.offset;
+            conn.io_busy = true;
+            return true;
         }
+        if (conn.out_head == conn.out.size()) reset_output(conn);
+        if (batch.chunks.empty()) return true;
+        batch.iov.clear();
+        for (const OutputChunk &chunk : batch.chunks) {
+            const string &bytes = chunk.shared ? *chunk.shared : chunk.data;
+            batch.iov.push_back({(void *)(bytes.data() + chunk.offset), bytes.size() - chunk.offset});
+        }
+        batch.msg = {};
+        batch.msg.msg_iov = batch.iov.data();
+        batch.msg.msg_iovlen = batch.iov.size();
+        struct io_uring_sqe *sqe = queue(IoOp::SEND, conn.fd, conn.id);
+        if (!sqe) return false;
+        count(SOCKET_WRITES);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)&batch.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        conn.io_busy = true;
+        return true;
+    }
 
-        cout << "\nPOP3 client connected" << endl;
-        // Handle POP3 client in a new thread
-        thread client_thread(handle_pop3_client, new_socket);
-        client_thread.detach();
+    static size_t chunk_size(const OutputChunk &chunk) {
+        return chunk.shared ? chunk.shared->size() : chunk.data.size();
     }
-    close(server_fd);
-}
 
-// --- SMTP Mail Sending Logic ---
+    // Drop the chunks of the batch that are fully sent. A small reply buffer
+    // among them is handed back to 'out' if that has none, so the next
+    // replies are written into it instead of a new allocation.
+    void release_sent(Connection &conn) {
+        SendBatch &batch = conn.sending;
+        for (size_t i = 0; i < batch.head; ++i) {
+            string &done = batch.chunks[i].data;
+            if (conn.out.size() == 1 && conn.out_head == 0 && conn.out[0].file_fd < 0 && !conn.out[0].shared &&
+                conn.out[0].data.empty() && conn.out[0].data.capacity() < done.capacity() &&
+                done.capacity() <= KEPT_BUFFER) {
+                conn.out[0].data.swap(done);
+                conn.out[0].data.clear();
+            }
+        }
+        batch.chunks.erase(batch.chunks.begin(), batch.chunks.begin() + batch.head);
+        batch.head = 0;
+    }
 
-void handle_smtp_client(int client_socket) {
-    send_response(client_socket, "220 localhost Simple SMTP Server");
+    void complete(const struct io_uring_cqe &cqe) {
+        IoOp op = (IoOp)(cqe.user_data >> 56);
+        int fd = (int)(uint32_t)cqe.user_data;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (op == IoOp::WAKE) {
+            run_tasks();
+            if (!more) arm_wake();
+            return;
+        }
+        if (op == IoOp::ACCEPT) {
+            const Listener &listener = *find_listener(fd);
+            if (cqe.res >= 0) {
+                add_client(listener, cqe.res);
+            } else if ((cqe.res == -EMFILE || cqe.res == -ENFILE) && spare_fd >= 0) {
+                refuse_client(listener);
+            } else if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+                LOG(LogLevel::ERROR, "%s accept failed: %s",
+                    listener.protocol == Protocol::SMTP ? "SMTP" : "POP3", strerror(-cqe.res));
+            }
+            if (!more) arm_accept(listener);
+            return;
+        }
 
-    string mail_from;
-    string rcpt_to; 
-    string data_body;
-    bool in_data_mode = false;
-    char buffer[1024] = {0};
-
-    // main session
-    while(true){
-        memset(buffer, 0, sizeof(buffer));
-        int bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if(bytes_received <= 0) break;
-
-        string command(buffer);
-        command.erase(command.find_last_not_of(" \r\n") + 1);
-        cout << "SMTP Client Recv: " << command << endl;
-
-        if (in_data_mode) {
-            if (command.length() == 1 && command[0] == '.') { 
-                in_data_mode = false;
-                
-                string cleaned_rcpt_to = clean_email_for_filename(rcpt_to);
-                string filename = cleaned_rcpt_to + ".txt";
-
-                ofstream outfile(filename, ios::app);
-                if (outfile.is_open()) {
-                    // Save the received body content (which includes headers)
-                    outfile << data_body; 
-                    // Final newline before the delimiter
-                    if (data_body.empty() || data_body.back() != '\n') {
-                        outfile << "\n";
+        // The rest belong to sessions, which may have closed meanwhile
+        auto it = connections.find(fd);
+        Connection *conn = nullptr;
+        if (it != connections.end() && (it->second->id & TAG_ID_MASK) == ((cqe.user_data >> 32) & TAG_ID_MASK)) {
+            conn = it->second.get();
+        }
+        bool ok = conn != nullptr;
+        if (op == IoOp::CANCEL) {
+            // The receive had already ended or could not be stopped; the
+            // next bytes for the paused session try again
+            if (conn && cqe.res < 0) conn->recv_cancelled = false;
+            return;
+        }
+        if (op == IoOp::RECV) {
+            // Zero is the end of the stream, which only matters once the
+            // session's last reply is out if it is closing anyway
+            ok = ok && (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED ||
+                        (cqe.res == 0 && conn->closing));
+            if (ok && !more) conn->receiving = false;
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (ok && cqe.res > 0) {
+                    // More input for a session already waiting on its delivery
+                    if (conn->paused) cancel_recv(*conn);
+                    ok = receive(*conn, ring->buffer(buffer), cqe.res);
+                }
+                ring->recycle(buffer);
+            }
+            if (ok && !conn->receiving && !conn->paused && cqe.res != 0) ok = arm_recv(*conn);
+        } else if (!conn) {
+            orphans.erase(io_key(cqe.user_data));
+            return;
+        } else if (op == IoOp::SEND) {
+            conn->io_busy = false;
+            ok = cqe.res >= 0;
+            if (cqe.res > 0) {
+                count(BYTES_SENT, cqe.res);
+                conn->last_active_ms = clock_ms;
+                // Step past what was sent, which may end inside a chunk
+                SendBatch &batch = conn->sending;
+                size_t left = cqe.res;
+                while (left > 0 && batch.head < batch.chunks.size()) {
+                    OutputChunk &done = batch.chunks[batch.head];
+                    size_t pending = chunk_size(done) - done.offset;
+                    if (left < pending) {
+                        done.offset += left;
+                        break;
                     }
-                    // Use a unique delimiter so POP3 can split messages
-                    outfile << "--- END OF MESSAGE ---\n"; 
-                    outfile.close();
-                    send_response(client_socket, "250 OK Message accepted for delivery");
-                } else {
-                    send_response(client_socket, "451 Requested action aborted: local error in processing");
+                    left -= pending;
+                    done.offset += pending;
+                    ++batch.head;
                 }
-                
-                mail_from.clear();
-                rcpt_to.clear();
-                data_body.clear();
-            } else {
-                // Store in in-memory list. Newlines were added by client_smtp.
-                data_body += command + "\n"; 
             }
         } else {
-            string verb = command.substr(0, command.find(' '));
-            std::transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
-            
-            if(verb == "HELO") {
-                send_response(client_socket, "250 Hello");
-            } else if(verb == "MAIL") {
-                mail_from = extract_field(command, "FROM:");
-                send_response(client_socket, "250 Sender OK");
-            } else if (verb == "RCPT") {
-                rcpt_to = extract_field(command, "TO:");
-                send_response(client_socket, "250 Recipient OK");
-            } else if (verb == "DATA") {
-                in_data_mode = true;
-                send_response(client_socket, "354 Start mail input; end with <CRLF>.<CRLF>");
-            } else if (verb == "QUIT") {
-                send_response(client_socket, "221 Bye");
-                break;
-            } else {
-                send_response(client_socket, "500 Syntax error, command unrecognized");
+            conn->io_busy = false;
+            // A file that shrank underneath us would otherwise never finish
+            ok = cqe.res > 0;
+            if (ok) {
+                OutputChunk &chunk = conn->out[conn->out_head];
+                conn->sending.chunks.back().data.resize(cqe.res);
+                chunk.offset += cqe.res;
+                chunk.length -= cqe.res;
+                if (chunk.length == 0) {
+                    if (chunk.owns_fd) close(chunk.file_fd);
+                    chunk.owns_fd = false;
+                    ++conn->out_head;
+                }
             }
         }
+        if (!conn) return;
+        if (ok) ok = flush_client(*conn);
+        if (!ok) {
+            close_client(*conn);
+            return;
+        }
+        arm_timer(*conn);
     }
-    close(client_socket);
+};
+
+void post_delivery_result(EventLoop *loop, int fd, uint64_t id, bool ok) {
+    loop->post([loop, fd, id, ok]() { loop->complete_delivery(fd, id, ok); });
 }
 
-// Thread function for the SMTP Listener
-void smtp_listener() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    const int SMTP_PORT = 2525;
-    int opt = 1;
+// --- Metrics Export ---
 
-    // socket creation and setup
-    if((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0){
-        cerr << "SMTP Socket creation failed" << endl;
-        return;
+// Render every metric in the Prometheus text exposition format
+string render_metrics() {
+    uint64_t counters[NUM_COUNTERS] = {};
+    uint64_t buckets[NUM_HISTOGRAMS][HISTOGRAM_BUCKETS] = {};
+    uint64_t sum_us[NUM_HISTOGRAMS] = {};
+    {
+        lock_guard<mutex> guard(metrics_lock);
+        for (ThreadMetrics *metrics : all_metrics) {
+            for (int i = 0; i < NUM_COUNTERS; ++i) {
+                counters[i] += metrics->counters[i].load(memory_order_relaxed);
+            }
+            for (int h = 0; h < NUM_HISTOGRAMS; ++h) {
+                for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                    buckets[h][b] += metrics->buckets[h][b].load(memory_order_relaxed);
+                }
+                sum_us[h] += metrics->sum_us[h].load(memory_order_relaxed);
+            }
+        }
     }
-    if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))){
-        perror("SMTP setsockopt");
-        return;
+
+    ostringstream out;
+    out.precision(12);
+    auto header = [&out](const char *name, const char *type, const char *help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+
+    header("mail_connections_accepted_total", "counter", "Client connections accepted");
+    out << "mail_connections_accepted_total{protocol=\"smtp\"} " << counters[SMTP_ACCEPTED] << "\n"
+        << "mail_connections_accepted_total{protocol=\"pop3\"} " << counters[POP3_ACCEPTED] << "\n";
+    header("mail_connections_rejected_total", "counter", "Client connections refused at accept");
+    out << "mail_connections_rejected_total{protocol=\"smtp\"} " << counters[SMTP_REJECTED] << "\n"
+        << "mail_connections_rejected_total{protocol=\"pop3\"} " << counters[POP3_REJECTED] << "\n";
+    header("mail_connections_active", "gauge", "Client connections currently open");
+    out << "mail_connections_active{protocol=\"smtp\"} " << counters[SMTP_ACCEPTED] - counters[SMTP_CLOSED] << "\n"
+        << "mail_connections_active{protocol=\"pop3\"} " << counters[POP3_ACCEPTED] - counters[POP3_CLOSED] << "\n";
+
+    header("mail_commands_total", "counter", "Protocol commands received, by verb");
+    for (size_t i = 0; i < NUM_SMTP_VERBS; ++i) {
+        out << "mail_commands_total{protocol=\"smtp\",verb=\"" << SMTP_VERBS[i] << "\"} "
+            << counters[SMTP_COMMANDS + i] << "\n";
+    }
+    for (size_t i = 0; i < NUM_POP3_VERBS; ++i) {
+        out << "mail_commands_total{protocol=\"pop3\",verb=\"" << POP3_VERBS[i] << "\"} "
+            << counters[POP3_COMMANDS + i] << "\n";
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(SMTP_PORT);
+    header("mail_session_timeouts_total", "counter", "Sessions closed for idling too long");
+    out << "mail_session_timeouts_total " << counters[SESSION_TIMEOUTS] << "\n";
+    header("mail_slow_clients_evicted_total", "counter", "Sessions closed for sending DATA too slowly");
+    out << "mail_slow_clients_evicted_total " << counters[SLOW_EVICTIONS] << "\n";
 
-    if(bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0){
-        cerr << "SMTP Bind failed. Check if port " << SMTP_PORT << " is already in use." << endl;
-        return;
+    header("mail_io_uring_enters_total", "counter", "io_uring_enter calls, each submitting and reaping a batch");
+    out << "mail_io_uring_enters_total " << counters[IO_URING_ENTERS] << "\n";
+    header("mail_io_uring_completions_total", "counter", "io_uring operations completed");
+    out << "mail_io_uring_completions_total " << counters[IO_URING_COMPLETIONS] << "\n";
+
+    header("mail_bytes_received_total", "counter", "Bytes read from client sockets");
+    out << "mail_bytes_received_total " << counters[BYTES_RECEIVED] << "\n";
+    header("mail_bytes_sent_total", "counter", "Bytes written to client sockets");
+    out << "mail_bytes_sent_total " << counters[BYTES_SENT] << "\n";
+    header("mail_socket_writes_total", "counter", "System calls or io_uring sends that wrote client output");
+    out << "mail_socket_writes_total " << counters[SOCKET_WRITES] << "\n";
+#ifdef COUNT_ALLOCATIONS
+    header("mail_handler_allocations_total", "counter", "Heap allocations made while handling commands");
+    out << "mail_handler_allocations_total " << counters[HANDLER_ALLOCATIONS] << "\n";
+#endif
+    header("mail_messages_delivered_total", "counter", "Messages committed to a mailbox");
+    out << "mail_messages_delivered_total " << counters[MESSAGES_DELIVERED] << "\n";
+    header("mail_delivery_failures_total", "counter", "Messages that could not be stored");
+    out << "mail_delivery_failures_total " << counters[DELIVERY_FAILURES] << "\n";
+    header("mail_commit_batches_total", "counter", "Group commits (one sync each per mailbox)");
+    out << "mail_commit_batches_total " << counters[COMMIT_BATCHES] << "\n";
+    header("mail_messages_indexed_total", "counter", "Messages added to search indexes");
+    out << "mail_messages_indexed_total " << counters[MESSAGES_INDEXED] << "\n";
+    header("mail_messages_deleted_total", "counter", "Messages removed by POP3 DELE");
+    out << "mail_messages_deleted_total " << counters[MESSAGES_DELETED] << "\n";
+    header("mail_compactions_total", "counter", "Mailboxes rewritten without their deleted messages");
+    out << "mail_compactions_total " << counters[COMPACTIONS] << "\n";
+
+    CacheStats cache = mailbox_cache->stats();
+    header("mail_cache_requests_total", "counter", "Mailbox cache lookups, by kind and result");
+    out << "mail_cache_requests_total{kind=\"listing\",result=\"hit\"} " << cache.listing_hits << "\n"
+        << "mail_cache_requests_total{kind=\"listing\",result=\"miss\"} " << cache.listing_misses << "\n"
+        << "mail_cache_requests_total{kind=\"body\",result=\"hit\"} " << cache.body_hits << "\n"
+        << "mail_cache_requests_total{kind=\"body\",result=\"miss\"} " << cache.body_misses << "\n";
+    header("mail_cache_evictions_total", "counter", "Mailboxes evicted from the cache");
+    out << "mail_cache_evictions_total " << cache.evictions << "\n";
+    header("mail_cache_bytes", "gauge", "Memory held by the mailbox cache");
+    out << "mail_cache_bytes " << cache.bytes << "\n";
+
+    for (int h = 0; h < NUM_HISTOGRAMS; ++h) {
+        const char *name = HISTOGRAM_NAMES[h];
+        header(name, "histogram", HISTOGRAM_HELP[h]);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            cumulative += buckets[h][b];
+            out << name << "_bucket{le=\"";
+            if (b == HISTOGRAM_BUCKETS - 1) {
+                out << "+Inf";
+            } else {
+                out << (double)(1ull << b) / 1e6;
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << name << "_sum " << (double)sum_us[h] / 1e6 << "\n"
+            << name << "_count " << cumulative << "\n";
     }
+    return out.str();
+}
 
-    if(listen(server_fd, 10) < 0){
-        perror("SMTP listen failed");
+// Serve the metrics over HTTP on the loopback interface. Scrapes are rare and
+// tiny, so this runs on its own thread, away from the event loops.
+void serve_metrics(int port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server_fd, 16) < 0) {
+        LOG(LogLevel::ERROR, "Metrics port %d unavailable: %s", port, strerror(errno));
+        close(server_fd);
         return;
     }
+    LOG(LogLevel::INFO, "Metrics available on http://127.0.0.1:%d/metrics", port);
+
+    while (true) {
+        int client = accept4(server_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+        // The request itself does not matter; wait briefly for it, then answer
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        recv(client, request, sizeof(request), 0);
+
+        string body = render_metrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+        write_all(client, response.data(), response.size());
+        close(client);
+    }
+}
 
-    cout << "SMTP Server listening on port " << SMTP_PORT << endl;
+// Rewrite the metrics file every 'interval' seconds (atomically, via rename)
+void dump_metrics(string path, int interval) {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(interval));
+        string body = render_metrics();
+        string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) continue;
+        bool ok = write_all(fd, body.data(), body.size());
+        close(fd);
+        if (ok) rename(tmp.c_str(), path.c_str());
+    }
+}
 
-    while(true){
-        if((new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0){
-            perror("SMTP accept failed");
+// Report cache effectiveness now and then so it can be sized
+void report_cache_stats() {
+    CacheStats last;
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(60));
+        CacheStats now = mailbox_cache->stats();
+        if (now.listing_hits + now.listing_misses + now.body_hits + now.body_misses ==
+            last.listing_hits + last.listing_misses + last.body_hits + last.body_misses) {
             continue;
         }
+        LOG(LogLevel::INFO, "Mailbox cache: listings %llu hits / %llu misses, bodies %llu hits / %llu misses, "
+            "%llu evictions, %llu KB", (unsigned long long)now.listing_hits,
+            (unsigned long long)now.listing_misses, (unsigned long long)now.body_hits,
+            (unsigned long long)now.body_misses, (unsigned long long)now.evictions,
+            (unsigned long long)(now.bytes >> 10));
+        last = now;
+    }
+}
+
+// --- Offline Conversion ---
+
+// Rewrite a flat mailbox (<user>.txt) as a packed one (<user>.seg and
+// <user>.sidx), keeping UIDs and the header index. Run with the server
+// stopped; the .txt file is left in place for the operator to remove.
+bool pack_mailbox(const string &mailbox) {
+    if (access(segment_path(mailbox).c_str(), F_OK) == 0) {
+        LOG(LogLevel::ERROR, "%s already exists", segment_path(mailbox).c_str());
+        return false;
+    }
+    FlatFileStore flat;
+    vector<MessageMeta> listing = flat.load_listing(mailbox);
+    if (listing.empty() && access(mailbox_path(mailbox).c_str(), F_OK) != 0) {
+        LOG(LogLevel::ERROR, "No mailbox %s", mailbox_path(mailbox).c_str());
+        return false;
+    }
+    unordered_map<uint64_t, MessageSummary> summaries = flat.load_summaries(mailbox);
+
+    string seg_tmp = segment_path(mailbox) + ".tmp", idx_tmp = segment_index_path(mailbox) + ".tmp";
+    int seg = open(seg_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int idx = open(idx_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = seg >= 0 && idx >= 0 && write_all(idx, (const char *)&SEGMENT_INDEX_MAGIC, sizeof(SEGMENT_INDEX_MAGIC));
+    uint64_t raw = 0, packed = 0;
+    vector<MessageSummary> missing;  // Messages the header index lacks
+    vector<MessageMeta> missing_meta;
+    for (size_t i = 0; ok && i < listing.size(); ++i) {
+        MessageSource source;
+        ok = flat.open_message(mailbox, listing[i], source);
+        if (!ok) break;
+        string message = read_source(source, 0, source_length(source));
+        if (!summaries.count(listing[i].uid)) {
+            missing.push_back(summarize_message(source));
+            missing_meta.push_back(listing[i]);
+        }
+        if (source.owns_fd) close(source.fd);
+
+        string block;
+        encode_block(listing[i].uid, message, block);
+        SegmentRecord record = {packed, block.size() - sizeof(BlockHeader), message.size(), listing[i].uid};
+        ok = write_all(seg, block.data(), block.size()) &&
+             write_all(idx, (const char *)&record, sizeof(record));
+        raw += message.size();
+        packed += block.size();
+    }
+    ok = ok && fsync(seg) == 0 && fsync(idx) == 0;
+    if (seg >= 0) close(seg);
+    if (idx >= 0) close(idx);
+    if (!ok || rename(idx_tmp.c_str(), segment_index_path(mailbox).c_str()) != 0 ||
+        rename(seg_tmp.c_str(), segment_path(mailbox).c_str()) != 0) {
+        LOG(LogLevel::ERROR, "Could not pack %s", mailbox.c_str());
+        unlink(seg_tmp.c_str());
+        unlink(idx_tmp.c_str());
+        return false;
+    }
+    sync_directory(".");
+
+    vector<const MessageSummary *> added;
+    for (const MessageSummary &summary : missing) added.push_back(&summary);
+    if (!added.empty()) append_summaries(summary_path(mailbox), added, missing_meta);
+    LOG(LogLevel::INFO, "Packed %s: %zu messages, %llu bytes into %llu", mailbox.c_str(), listing.size(),
+        (unsigned long long)raw, (unsigned long long)packed);
+    return true;
+}
+
+// Rebuild a mailbox's search index from what the store holds, in batches
+bool reindex_mailbox(const string &mailbox) {
+    const size_t BATCH = 4096;
+    for (const string &name : search_segments(mailbox)) {
+        unlink((search_dir(mailbox) + "/" + name).c_str());
+    }
+    vector<MessageMeta> listing = mail_store->load_listing(mailbox);
+    uint64_t started = now_us();
+    vector<pair<uint64_t, string>> batch;
+    for (size_t i = 0; i < listing.size(); ++i) {
+        MessageSource source;
+        if (!mail_store->open_message(mailbox, listing[i], source)) continue;
+        batch.push_back({listing[i].uid, read_source(source, 0, MAX_INDEXED_BYTES)});
+        if (source.owns_fd) close(source.fd);
+        if (batch.size() == BATCH || i + 1 == listing.size()) {
+            if (!index_messages(mailbox, batch)) {
+                LOG(LogLevel::ERROR, "Could not index %s", mailbox.c_str());
+                return false;
+            }
+            batch.clear();
+        }
+    }
+    LOG(LogLevel::INFO, "Indexed %s: %zu messages in %.1f ms, %zu segments", mailbox.c_str(), listing.size(),
+        (now_us() - started) / 1000.0, search_segments(mailbox).size());
+    return true;
+}
+
+// The local search tool: print the messages of a mailbox matching 'query'
+void print_search(const string &mailbox, const string &query) {
+    uint64_t started = now_us();
+    vector<uint64_t> uids = search_mailbox(mailbox, query);
+    uint64_t elapsed = now_us() - started;
+
+    vector<MessageMeta> listing = mail_store->load_listing(mailbox);
+    unordered_map<uint64_t, MessageSummary> summaries = mail_store->load_summaries(mailbox);
+    unordered_map<uint64_t, size_t> numbers;
+    for (size_t i = 0; i < listing.size(); ++i) {
+        numbers[listing[i].uid] = i + 1;
+    }
+    for (uint64_t uid : uids) {
+        auto number = numbers.find(uid);
+        auto summary = summaries.find(uid);
+        cout << (number == numbers.end() ? 0 : number->second) << " " << format_uid(uid) << "\t"
+             << (summary == summaries.end() ? "" : summary->second.from) << "\t"
+             << (summary == summaries.end() ? "" : summary->second.subject) << "\n";
+    }
+    cerr << uids.size() << " matches in " << elapsed / 1000.0 << " ms\n";
+}
 
-        cout << "\nSMTP client connected" << endl;
-        // Handle SMTP client in a new thread
-        thread client_thread(handle_smtp_client, new_socket);
-        client_thread.detach();
+// --- Configuration ---
+
+struct ServerConfig {
+    // Number of shards; each is one event loop thread with its own listeners
+    unsigned shards = max(1u, min(thread::hardware_concurrency(), 4u));
+    // Pin shard i to the i-th CPU of this list ("auto": all usable CPUs); empty = no pinning
+    string pin_cpus;
+    // Pending-connection queue of each listening socket (capped by net.core.somaxconn)
+    int backlog = 1024;
+    // Socket and file I/O: "auto" (io_uring where the kernel allows it), "uring" or "epoll"
+    string io_backend = "auto";
+    // Least important messages that still get logged
+    LogLevel log_level = LogLevel::INFO;
+    // Storage engine: "flat" (<user>.txt + index), "maildir" or "packed"
+    string store = "flat";
+    // Flat mailboxes to convert to the packed format (then exit)
+    vector<string> pack;
+    // Index deliveries for XSEARCH
+    bool search_index = true;
+    // Offline: mailboxes whose search index to rebuild, or one query to run (then exit)
+    vector<string> reindex;
+    string search_mailbox;
+    string search_query;
+    // Mailbox cache budget, and the largest message body it will hold
+    size_t cache_mb = 64;
+    size_t cache_body_kb = 64;
+    // Metrics export: loopback HTTP port and/or a periodically rewritten file
+    int metrics_port = 0;
+    string metrics_file;
+    int metrics_interval = 10;
+    // Delivery writer shards; each is one thread owning a slice of the mailboxes
+    unsigned delivery_threads = 2;
+    // How long a delivery shard waits to gather a batch before committing
+    unsigned commit_window_us = 0;
+    // Largest message accepted over SMTP, in bytes
+    uint64_t max_message_size = 64ull << 20;
+    // Session caps, per-state timeouts and the DATA throughput floor
+    SessionLimits limits;
+    // Percentage of deleted messages at which a mailbox gets compacted (0 = never)
+    unsigned compact_threshold = 25;
+};
+
+void print_usage(const char *program) {
+    cerr << "Usage: " << program << " [options]\n"
+         << "  --shards N             event loop shards, each with its own listeners (alias --threads)\n"
+         << "  --pin-cpus auto|LIST   pin shard i to the i-th CPU of LIST, e.g. 0-3 or 0,2,4\n"
+         << "  --backlog N            listen backlog per shard socket\n"
+         << "  --io-backend NAME      auto (default), uring or epoll: how sockets and mailbox writes are driven\n"
+         << "  --log-level LEVEL      error, warn, info (default), debug or trace\n"
+         << "  --store ENGINE         mailbox storage engine: flat, maildir or packed (compressed)\n"
+         << "  --pack MAILBOX         convert a flat mailbox to packed and exit (repeatable, server stopped)\n"
+         << "  --search-index 0|1     index deliveries for full-text search (XSEARCH; default 1)\n"
+         << "  --index MAILBOX        rebuild a mailbox's search index from --store and exit (repeatable)\n"
+         << "  --search MAILBOX TEXT  print the messages matching every word of TEXT and exit\n"
+         << "  --cache-mb N           shared mailbox cache size (0 disables)\n"
+         << "  --cache-body-kb N      largest message body kept in the cache\n"
+         << "  --delivery-threads N   mailbox writer threads\n"
+         << "  --commit-window-us N   delivery batching window (0 = commit as soon as possible)\n"
+         << "  --max-message-size N   largest message accepted, in bytes (advertised as SIZE)\n"
+         << "  --compact-threshold P  rewrite a mailbox once P% of its messages are deleted (0 = never)\n"
+         << "  --max-smtp-sessions N  concurrent SMTP sessions before new ones get 421 (0 = no cap)\n"
+         << "  --max-pop3-sessions N  concurrent POP3 sessions before new ones get -ERR (0 = no cap)\n"
+         << "  --greeting-timeout S   seconds a client may take to send its first command\n"
+         << "  --smtp-timeout S       seconds between SMTP commands (default 300)\n"
+         << "  --pop3-timeout S       POP3 autologout timer (default 600)\n"
+         << "  --data-timeout S       seconds between data blocks in DATA (default 180)\n"
+         << "  --min-data-rate N      bytes/s a client must sustain during DATA (0 disables)\n"
+         << "  --metrics-port N       serve Prometheus metrics on 127.0.0.1:N\n"
+         << "  --metrics-file PATH    also write them to PATH every --metrics-interval seconds\n";
+}
+
+bool parse_args(int argc, char *argv[], ServerConfig &config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        if (arg == "--shards" || arg == "--threads") {
+            config.shards = max(1, atoi(argv[++i]));
+        } else if (arg == "--pin-cpus") {
+            config.pin_cpus = argv[++i];
+        } else if (arg == "--backlog") {
+            config.backlog = max(1, atoi(argv[++i]));
+        } else if (arg == "--io-backend") {
+            config.io_backend = argv[++i];
+            if (config.io_backend != "auto" && config.io_backend != "uring" && config.io_backend != "epoll") return false;
+        } else if (arg == "--log-level") {
+            string level = argv[++i];
+            transform(level.begin(), level.end(), level.begin(), ::toupper);
+            auto name = find(begin(LOG_LEVEL_NAMES), end(LOG_LEVEL_NAMES), level);
+            if (name == end(LOG_LEVEL_NAMES)) return false;
+            config.log_level = (LogLevel)(name - begin(LOG_LEVEL_NAMES));
+        } else if (arg == "--store") {
+            config.store = argv[++i];
+            if (config.store != "flat" && config.store != "maildir" && config.store != "packed") return false;
+        } else if (arg == "--pack") {
+            config.pack.push_back(argv[++i]);
+        } else if (arg == "--search-index") {
+            config.search_index = atoi(argv[++i]) != 0;
+        } else if (arg == "--index") {
+            config.reindex.push_back(argv[++i]);
+        } else if (arg == "--search") {
+            if (i + 2 >= argc) return false;
+            config.search_mailbox = argv[++i];
+            config.search_query = argv[++i];
+        } else if (arg == "--cache-mb") {
+            config.cache_mb = max(0, atoi(argv[++i]));
+        } else if (arg == "--cache-body-kb") {
+            config.cache_body_kb = max(0, atoi(argv[++i]));
+        } else if (arg == "--metrics-port") {
+            config.metrics_port = atoi(argv[++i]);
+        } else if (arg == "--metrics-file") {
+            config.metrics_file = argv[++i];
+        } else if (arg == "--metrics-interval") {
+            config.metrics_interval = max(1, atoi(argv[++i]));
+        } else if (arg == "--delivery-threads") {
+            config.delivery_threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--commit-window-us") {
+            config.commit_window_us = max(0, atoi(argv[++i]));
+        } else if (arg == "--max-message-size") {
+            config.max_message_size = strtoull(argv[++i], nullptr, 10);
+            if (config.max_message_size == 0) return false;
+        } else if (arg == "--compact-threshold") {
+            config.compact_threshold = min(100, max(0, atoi(argv[++i])));
+        } else if (arg == "--max-smtp-sessions") {
+            config.limits.max_sessions[(int)Protocol::SMTP] = max(0, atoi(argv[++i]));
+        } else if (arg == "--max-pop3-sessions") {
+            config.limits.max_sessions[(int)Protocol::POP3] = max(0, atoi(argv[++i]));
+        } else if (arg == "--greeting-timeout") {
+            config.limits.greeting_timeout = max(1, atoi(argv[++i]));
+        } else if (arg == "--smtp-timeout") {
+            config.limits.smtp_timeout = max(1, atoi(argv[++i]));
+        } else if (arg == "--pop3-timeout") {
+            config.limits.pop3_timeout = max(1, atoi(argv[++i]));
+        } else if (arg == "--data-timeout") {
+            config.limits.data_timeout = max(1, atoi(argv[++i]));
+        } else if (arg == "--min-data-rate") {
+            config.limits.min_data_rate = strtoull(argv[++i], nullptr, 10);
+        } else {
+            return false;
+        }
     }
-    close(server_fd);
+    return true;
 }
 
-int main() {
-    // Start both listeners concurrently
-    thread smtp_thread(smtp_listener);
-    thread pop3_thread(pop3_listener);
+int main(int argc, char *argv[]) {
+    ServerConfig config;
+    if (!parse_args(argc, argv, config)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    log_level = config.log_level;
+    max_message_size = config.max_message_size;
+    session_limits = config.limits;
+
+    // Finish any compaction a crash interrupted before anything reads a mailbox
+    recover_compactions();
+
+    if (!config.pack.empty()) {
+        bool ok = true;
+        for (const string &mailbox : config.pack) {
+            ok = pack_mailbox(mailbox) && ok;
+        }
+        logger().flush();
+        return ok ? 0 : 1;
+    }
+
+    if (config.store == "maildir") {
+        mail_store = new MaildirStore;
+    } else if (config.store == "packed") {
+        mail_store = new PackedStore;
+    } else {
+        mail_store = new FlatFileStore;
+    }
+
+    if (!config.reindex.empty() || !config.search_mailbox.empty()) {
+        bool ok = true;
+        for (const string &mailbox : config.reindex) {
+            ok = reindex_mailbox(mailbox) && ok;
+        }
+        if (!config.search_mailbox.empty()) {
+            print_search(config.search_mailbox, config.search_query);
+        }
+        logger().flush();
+        return ok ? 0 : 1;
+    }
+    LOG(LogLevel::INFO, "Using %s mailbox store", mail_store->name());
+
+    // Everything started from here on (event loops, delivery shards) uses the chosen backend
+    if (config.io_backend != "epoll") {
+        string reason;
+        if (io_uring_usable(reason)) {
+            io_backend = IoBackend::URING;
+        } else if (config.io_backend == "uring") {
+            LOG(LogLevel::ERROR, "io_uring is not available: %s", reason.c_str());
+            logger().flush();
+            return 1;
+        } else {
+            LOG(LogLevel::INFO, "io_uring is not available (%s)", reason.c_str());
+        }
+    }
+    LOG(LogLevel::INFO, "Using %s I/O backend", io_backend == IoBackend::URING ? "io_uring" : "epoll");
+
+    clear_spool();
+    mailbox_cache = new MailboxCache(config.cache_mb << 20, config.cache_body_kb << 10);
+    if (config.search_index) {
+        search_indexer = new SearchIndexer;
+    }
+    delivery_writer = new DeliveryWriter(*mail_store, config.delivery_threads,
+                                         chrono::microseconds(config.commit_window_us));
+    if (config.compact_threshold > 0) {
+        compactor = new Compactor(config.compact_threshold / 100.0);
+    }
+
+    vector<int> cpus;
+    if (!config.pin_cpus.empty() && !parse_cpu_list(config.pin_cpus, cpus)) {
+        LOG(LogLevel::ERROR, "Invalid CPU list: %s", config.pin_cpus.c_str());
+        logger().flush();
+        return 1;
+    }
+
+    // Bind every shard's listeners up front so a port problem fails startup
+    vector<vector<Listener>> shard_listeners(config.shards);
+    for (vector<Listener> &listeners : shard_listeners) {
+        int smtp_fd = open_listener("SMTP", 2525, config.backlog);
+        int pop3_fd = open_listener("POP3", 8110, config.backlog);
+        if (smtp_fd < 0 || pop3_fd < 0) {
+            logger().flush();
+            return 1;
+        }
+        listeners = {{smtp_fd, Protocol::SMTP}, {pop3_fd, Protocol::POP3}};
+    }
+    LOG(LogLevel::INFO, "SMTP on port 2525, POP3 on port 8110: %u shards, backlog %d%s", config.shards,
+        config.backlog, cpus.empty() ? "" : ", pinned");
+
+    // Start one event loop per shard
+    vector<thread> loop_threads;
+    for (unsigned i = 0; i < config.shards; ++i) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        loop_threads.emplace_back([&shard_listeners, i, cpu]() {
+            if (cpu >= 0) pin_to_cpu(cpu);
+            EventLoop loop(shard_listeners[i]);
+            loop.run();
+        });
+    }
+
+    thread(report_cache_stats).detach();
+    if (config.metrics_port > 0) {
+        thread(serve_metrics, config.metrics_port).detach();
+    }
+    if (!config.metrics_file.empty()) {
+        thread(dump_metrics, config.metrics_file, config.metrics_interval).detach();
+    }
+
+    // Keep the main thread alive until the loops exit
+    for (thread &t : loop_threads) {
+        t.join();
+    }
 
-    // Keep the main thread alive until the user decides to exit
-    smtp_thread.join();
-    pop3_thread.join();
-    
+    for (vector<Listener> &listeners : shard_listeners) {
+        for (Listener &listener : listeners) {
+            close(listener.fd);
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}